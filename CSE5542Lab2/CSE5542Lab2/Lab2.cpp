@@ -27,6 +27,27 @@ struct Memory
 	GLfloat angle;
 };
 
+/**
+ * @brief Yields the symbols of generation N one at a time by recursive descent
+ * over the rules, so the expanded string never has to be stored
+ */
+class LSystemStream
+{
+public:
+	LSystemStream(const std::string& axiom, int generation);
+	bool next(char& symbol);
+
+private:
+	struct Frame
+	{
+		const std::string* rule; // string being walked (axiom or a rule body)
+		size_t index; // next symbol to read from rule
+		int depth; // generation the symbols of rule belong to
+	};
+	std::vector<Frame> stack; // never deeper than generation + 1
+	int generation;
+};
+
 GLuint Angel::InitShader(const char* vShaderFile, const char* fShaderFile);
 GLuint program; /* shader program object id */
 GLuint vao_line; /* vertex array object id */
@@ -49,6 +70,7 @@ int floorFlag = 1; // 1: solid floor; 0: wireframe floor. Toggled by key 'f' or
 color3 color{1, 1, 1}; // color white
 
 int generation{};
+bool streamLSystem = false; // expand the l-system on the fly instead of storing tree
 GLfloat width{ 512 }, height{512};
 GLfloat gl_len{}, gl_scale{1}, scale_f{0.7};
 
@@ -78,6 +100,7 @@ void keyboard(unsigned char key, int x, int y);
 void initGrammars();
 void initLSystem(); // generate the gl_len-system string
 void generateLSystem(); // store all the line points in points
+void interpret(char symbol);
 
 void createEdge();
 void rotateLeft();
@@ -92,6 +115,11 @@ int main(int argc, char** argv)
 		generation = std::stoi(argv[2]);
 		angle = std::stof(argv[4]);
 		fileName = std::string(argv[5]);
+		for (int i = 6; i < argc; i++)
+		{
+			if (std::string(argv[i]) == "-stream")
+				streamLSystem = true;
+		}
 	}
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
@@ -314,11 +342,53 @@ void initGrammars()
 	}
 }
 
+LSystemStream::LSystemStream(const std::string& axiom, int generation)
+	: generation{ generation }
+{
+	stack.reserve(generation + 1);
+	stack.push_back({ &axiom, 0, 0 });
+}
+
+/**
+ * @brief Get the next symbol of the final generation
+ * @param symbol receives the symbol
+ * @return false once the whole string has been produced
+ */
+bool LSystemStream::next(char& symbol)
+{
+	while (!stack.empty())
+	{
+		Frame& top = stack.back();
+		if (top.index == top.rule->size())
+		{
+			stack.pop_back();
+			continue;
+		}
+		char current = (*top.rule)[top.index++];
+		if (top.depth < generation)
+		{
+			auto rule = grammers.find(current);
+			if (rule != grammers.end())
+			{
+				// descend into the rule instead of emitting the symbol
+				stack.push_back({ &rule->second, 0, top.depth + 1 });
+				continue;
+			}
+		}
+		symbol = current;
+		return true;
+	}
+	return false;
+}
+
 void initLSystem()
 {
 	for (int i = 0; i < generation; i++)
 	{
 		gl_scale *= scale_f;
+		// the streaming mode expands the symbols inside generateLSystem()
+		if (streamLSystem)
+			continue;
 		std::string newTree;
 		for (auto& symbol : tree)
 		{
@@ -344,30 +414,43 @@ void initLSystem()
 	}
 }
 
+void interpret(char symbol)
+{
+	if (symbol == 'F')
+	{
+		createEdge();
+	}
+	else if (symbol == '+')
+	{
+		rotateLeft();
+	}
+	else if (symbol == '-')
+	{
+		rotateRight();
+	}
+	else if (symbol == '[')
+	{
+		push();
+	}
+	else if (symbol == ']')
+	{
+		pop();
+	}
+}
+
 void generateLSystem()
 {
-	for (auto& symbol : tree)
+	if (streamLSystem)
 	{
-		if (symbol == 'F')
-		{
-			createEdge();
-		}
-		else if (symbol == '+')
-		{
-			rotateLeft();
-		}
-		else if (symbol == '-')
-		{
-			rotateRight();
-		}
-		else if (symbol == '[')
-		{
-			push();
-		}
-		else if (symbol == ']')
-		{
-			pop();
-		}
+		LSystemStream stream{ axiom, generation };
+		char symbol;
+		while (stream.next(symbol))
+			interpret(symbol);
+	}
+	else
+	{
+		for (auto& symbol : tree)
+			interpret(symbol);
 	}
 }
 
@@ -17,48 +17,631 @@ typedef Angel::vec3 color3;
 #include <string>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <climits>
+#include <cstdint>
+#include <cfloat>
 #include <GL/glew.h>
 #include <GL/glut.h>
 
+/**
+ * @brief Line of the l-system. All lines have the same color, buildStrips()
+ * adds it to the vertices of the lsystem VBO.
+ */
 struct Edge
 {
 	point3 startPoint;
 	point3 endPoint;
 };
 
+/**
+ * @brief Vertex of the indexed line strips the l-system is drawn with
+ */
+struct LVertex
+{
+	point3 position;
+	color3 color;
+};
+
+/**
+ * @brief Compact vertex of the line strips (-quantize) : the turtle only draws in
+ * the xy plane, so x and y quantized to the bounding box of the tree are enough
+ */
+struct QVertex
+{
+	GLshort x, y;
+};
+
+/**
+ * @brief Per instance data of a tree of the forest (vOffset, vTransform, vTint)
+ */
+struct TreeInstance
+{
+	vec3 offset; // position of the tree
+	GLfloat rotation; // around its own y axis in radians
+	GLfloat scale;
+	color3 tint; // multiplies the l-system color
+	GLfloat fade; // opacity, below 1 while a level of detail blends into the next
+};
+
+/**
+ * @brief Indices of one generation in the lsystem VBO of -lod
+ */
+struct LevelRange
+{
+	GLuint firstIndex;
+	GLsizei indexCount;
+	GLfloat scale; // makes the generation as large as generation N, around the root
+};
+
+/**
+ * @brief Image file decoded by stbi_load on a worker of decodeImages
+ */
+struct DecodedImage
+{
+	std::string path;
+	const std::string* file; // contents of path already read, nullptr to have stbi_load read it
+	unsigned char* data; // nullptr if the file failed to load, else freed with stbi_image_free
+	int width, height, channels;
+	double milliseconds; // decoding time
+};
+
+/**
+ * @brief std140 layout of the uniform block Frame shared by all shaders, written once per frame
+ */
+struct FrameBlock
+{
+	mat4 view; // LookAt of the camera, row major like the rest of mat.h
+	mat4 projection;
+};
+
+/**
+ * @brief Slots of the per-object uniform block Object in objectUBO, one per object drawn
+ */
+enum ObjectSlot
+{
+	FloorObject,
+	TreesObject,
+	Cube1Object,
+	Cube2Object,
+	LightCubeObject,
+	LightObject,
+	SkyboxObject,
+	ObjectCount
+};
+
+/**
+ * @brief Passes of the render queue, drawn one after the other
+ */
+enum RenderPass
+{
+	OpaquePass,
+	SkyboxPass // last, with GL_LEQUAL where nothing was drawn
+};
+
+/**
+ * @brief One draw submitted to the render queue, with the state it needs
+ */
+struct DrawPacket
+{
+	GLuint program;
+	GLuint vertexArray;
+	GLenum textureTarget; // 0 without a texture, else bound on unit 0
+	GLuint texture;
+	ObjectSlot object;
+	GLenum depthFunc;
+	std::function<void()> draw; // sets the rest and draws once the state above is bound
+};
+
+/**
+ * @brief State of the turtle that draws the l-system
+ */
 struct Memory
 {
-	Edge edge;
+	point3 position; // where the next edge starts
+	int turns; // heading as a multiple of angle, 0 is up
+};
+
+/**
+ * @brief The edge vector (-sin, cos) * gl_len of every heading the turtle can take.
+ * Headings are whole multiples of angle, so when angle divides 360 there are
+ * only 360 / angle of them and turns wrap around; otherwise the table covers
+ * the range of turns met so far and grows when the turtle leaves it.
+ */
+class HeadingTable
+{
+public:
+	void reset(GLfloat angle, GLfloat length);
+	int period() const;
+	int turn(int turns, int by) const;
+	const vec2& step(int turns);
+
+private:
+	vec2 direction(int turns) const;
+
 	GLfloat angle;
+	GLfloat length;
+	int periodTurns; // number of headings when angle divides 360, else 0
+	int lowest; // turns of steps[0]
+	std::vector<vec2> steps;
+};
+
+/**
+ * @brief L-system rules compiled into flat tables indexed by the symbol byte.
+ * Symbols without a rule produce themselves, so expanding any symbol is one copy.
+ */
+struct Grammar
+{
+	std::string productions; // the bodies of all productions stored back to back
+	unsigned int offset[256]; // start of the production of a symbol in productions
+	unsigned int length[256]; // length of the production of a symbol
+	bool rewritten[256]; // whether the symbol has a rule
+};
+
+/**
+ * @brief Maps the few symbols of an l-system onto 2 or 4 bit codes
+ */
+struct PackedAlphabet
+{
+	int bits; // bits per code, 2 or 4 (0 if there are too many symbols to pack)
+	int size; // number of symbols
+	unsigned char code[256]; // code of a symbol
+	char symbol[16]; // symbol of a code
+	char decode[256][4]; // the symbols stored in one packed byte, lowest bits first
+	unsigned int productionOffset[16]; // start of the production of a code in productions
+	unsigned int productionLength[16]; // length of the production of a code
+	std::vector<unsigned char> productions; // productions of all codes, as codes
+	unsigned int byteLength[256]; // total production length of the codes stored in one byte
+};
+
+/**
+ * @brief L-system string stored as 2 or 4 bit codes of a PackedAlphabet,
+ * packed into 64-bit words with the first symbol in the lowest bits
+ */
+class PackedString
+{
+public:
+	void reset(int bits, size_t length);
+	size_t size() const;
+	unsigned int code(size_t i) const;
+	void set(size_t i, unsigned int code);
+	size_t unpack(const PackedAlphabet& alphabet, size_t begin, size_t count, char* out) const;
+	size_t count(unsigned int code) const;
+	size_t bytes() const;
+
+	int bits = 4;
+	size_t length = 0;
+	std::vector<unsigned long long> words;
+};
+
+/**
+ * @brief Size of one l-system generation, predicted from the rules before expanding it
+ */
+struct LSystemSize
+{
+	unsigned long long symbols; // length of the l-system string
+	unsigned long long edges; // number of 'F', i.e. edges created by the turtle
+	unsigned long long depth; // deepest [ ] nesting, i.e. largest size of memories
+	unsigned long long vertexBytes; // size of the l-system VBO
+};
+
+/**
+ * @brief Yields the symbols of generation N one at a time by recursive descent
+ * over the rules, so the expanded string never has to be stored
+ */
+class LSystemStream
+{
+public:
+	LSystemStream(const std::string& axiom, int generation);
+	bool next(char& symbol);
+
+private:
+	friend class LSystemView;
+	LSystemStream() = default;
+
+	struct Frame
+	{
+		const char* next; // next symbol to read from the axiom or a production
+		const char* end; // end of the axiom or the production
+		int depth; // generation the symbols being read belong to
+	};
+	std::vector<Frame> stack; // never deeper than generation + 1
+	int generation;
+};
+
+/**
+ * @brief Generation N stored as a DAG of shared sub-expansions. A node stands
+ * for a symbol expanded a number of generations, and identical expansions are
+ * hash-consed into one node, so the DAG grows with the number of generations
+ * instead of with the length of the string.
+ */
+class LSystemDAG
+{
+public:
+	LSystemDAG(int generation);
+	size_t nodeCount() const;
+	unsigned long long size() const;
+	template <typename Visit>
+	void walk(Visit visit) const;
+
+private:
+	struct Node
+	{
+		std::vector<int> children; // sub-expansions in order, empty for a single symbol
+		unsigned long long length; // number of symbols of the expansion
+		std::string text; // the expansion itself when it is short
+	};
+	struct ChildrenHash
+	{
+		size_t operator()(const std::vector<int>& children) const;
+	};
+	int node(unsigned char symbol, int generations);
+	int intern(Node&& node);
+
+	std::vector<Node> nodes;
+	std::unordered_map<int, int> bySymbol; // generations * 256 + symbol -> node
+	std::unordered_map<std::vector<int>, int, ChildrenHash> byChildren; // hash-consing of the inner nodes
+	int root;
+};
+
+/**
+ * @brief Turtle state at some offset of the l-system string
+ */
+struct TurtleContext
+{
+	struct State
+	{
+		long long turns; // heading as a multiple of angle
+		double x, y; // where the next edge starts
+	};
+	State state{}; // current turtle state
+	std::vector<State> stack{}; // states saved by the open brackets, outermost first
+	bool valid = true; // false if the rules have unbalanced brackets, only stack.size() can be trusted then
+};
+
+/**
+ * @brief Random access into generation N without expanding it. For every symbol
+ * and every number of generations it keeps the length of the expansion and its
+ * effect on the turtle, so seeking walks down one production per generation.
+ */
+class LSystemView
+{
+public:
+	LSystemView(int generation);
+	unsigned long long size() const;
+	char seek(unsigned long long k, TurtleContext* context = nullptr) const;
+	LSystemStream streamFrom(unsigned long long k) const;
+
+private:
+	friend class LSystemHierarchy;
+	struct Expansion
+	{
+		unsigned long long length; // number of symbols
+		long long turns; // net number of '+' minus '-' outside of brackets
+		double dx, dy; // displacement of the turtle when it starts heading up
+		bool balanced; // every ']' closes a '[' of the same expansion
+	};
+	const Expansion& expansion(int generations, unsigned char symbol) const;
+	void apply(int generations, unsigned char symbol, TurtleContext& context) const;
+	template <typename Visit>
+	char descend(unsigned long long k, Visit visit) const;
+
+	int generation;
+	std::vector<Expansion> expansions; // [generations * 256 + symbol]
+};
+
+/**
+ * @brief Generation N of the l-system as copies of a few leaf meshes, each a
+ * symbol expanded leafGenerations generations, plus a tree of turtle moves.
+ * Node (symbol, k) stands for symbol expanded k levels above the leaves, its
+ * children are the symbols of its production one level down, each with the
+ * turtle state it starts from relative to the node. The size is
+ * O(generations * productions) however many edges the plant has, and the
+ * vertex shader finds the state of leaf copy i by walking down the tree.
+ */
+class LSystemHierarchy
+{
+public:
+	/**
+	 * @brief Mesh of one symbol expanded leafGenerations generations, drawn
+	 * instances times
+	 */
+	struct Leaf
+	{
+		unsigned char symbol;
+		GLuint firstIndex; // where its line strips start in indices
+		GLsizei indexCount;
+		GLsizei instances;
+	};
+	static const int maxLeaves = 4; // counts of the leaves of a child fit in one texel
+
+	LSystemHierarchy() = default;
+	LSystemHierarchy(int generation, int leafGenerations);
+
+	bool valid = false; // false if the rules can not be split into copies
+	int steps = 0; // levels the vertex shader walks down, the root included
+	GLuint root = 0; // node of the axiom
+	std::vector<GLuint> texels; // RGBA32UI texels of the tree, see the constructor
+	std::vector<Leaf> leaves;
+	std::vector<LVertex> vertices; // the leaf meshes
+	std::vector<GLuint> indices;
+};
+
+/**
+ * @brief Bounding box hierarchy over the edges of the l-system, for culling
+ * and picking. The turtle draws every bracket subtree as a run of consecutive
+ * edges, so the hierarchy splits the edge order, preferring splits where a
+ * line strip (a branch) starts. Every node is a range of edges and so a range
+ * of the lsystem EBO.
+ */
+class LSystemBVH
+{
+public:
+	struct Node
+	{
+		vec2 low, high; // bounding box in the xy plane of the tree
+		GLuint first, count; // edges
+		int left, right; // children, -1 for a leaf
+	};
+	static const GLuint leafSize = 64; // most edges of a leaf
+
+	void build(const std::vector<Edge>& lines, const std::vector<GLuint>& indices);
+	void cull(const mat4& mvp, std::vector<GLsizei>& counts, std::vector<GLuint>& firsts, size_t& visited) const;
+	long long pick(const mat4& mvp, GLfloat x, GLfloat y, GLfloat tolerance, GLfloat& depth) const;
+	void branch(size_t edge, GLuint& firstIndex, GLsizei& indexCount) const;
+	size_t nodeCount() const { return nodes.size(); }
+
+private:
+	int buildNode(GLuint first, GLuint count);
+	void emit(GLuint first, GLuint count, std::vector<GLsizei>& counts, std::vector<GLuint>& firsts) const;
+
+	const std::vector<Edge>* lines = nullptr;
+	const std::vector<GLuint>* indices = nullptr;
+	std::vector<GLuint> ends; // position in indices of the end point of every edge
+	std::vector<Node> nodes;
+};
+
+/**
+ * @brief The program, vertex array, textures, depth function and polygon mode
+ * last set through it. Setting one to what it already is makes no gl call.
+ * issued and skipped count the calls of the current frame, uniforms included.
+ */
+class GLStateCache
+{
+public:
+	GLStateCache() { invalidate(); }
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vertexArray);
+	void bindTexture(GLuint unit, GLenum target, GLuint texture); // glActiveTexture too if unit is not the active one
+	void depthFunc(GLenum func);
+	void polygonMode(GLenum mode); // of GL_FRONT_AND_BACK
+	void invalidate(); // forget everything, after gl calls that went around the cache
+	void endFrame(); // move the counts of the frame to lastIssued and lastSkipped
+	bool count(bool redundant); // count a call, true if it has to be made
+
+	size_t issued = 0, skipped = 0;
+	size_t lastIssued = 0, lastSkipped = 0;
+
+private:
+	static const GLuint unknown = 0xFFFFFFFFu;
+	static const int maxUnits = 8;
+	static int targetIndex(GLenum target); // 0 to 2, -1 for targets not cached
+
+	GLuint program;
+	GLuint vertexArray;
+	GLuint activeUnit;
+	GLuint textures[maxUnits][3]; // GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP and GL_TEXTURE_BUFFER of every unit
+	GLenum depth;
+	GLenum polygon;
+};
+
+/**
+ * @brief Draw packets of a frame, drawn sorted by a 64 bit key of pass,
+ * program, texture, vertex array and depth so draws sharing state follow
+ * each other and opaque ones go front to back
+ */
+class RenderQueue
+{
+public:
+	void submit(RenderPass pass, GLfloat depth, DrawPacket packet); // depth is the distance from the eye
+	void execute(); // sort, draw and empty the queue
+	size_t size() const { return packets.size(); }
+
+	static unsigned long long sortKey(RenderPass pass, const DrawPacket& packet, GLfloat depth);
+
+private:
+	struct Entry
+	{
+		unsigned long long key;
+		GLuint packet;
+	};
+	void sort(); // LSD radix sort of entries, a byte per pass
+
+	std::vector<DrawPacket> packets;
+	std::vector<Entry> entries;
+	std::vector<Entry> scratch;
+};
+
+/**
+ * @brief Buffers, vertex arrays and textures of the scene, made once per
+ * distinct content. Meshes are triangle soups cooked by cookMesh into
+ * indexed triangles. Meshes with the same vertices share one VBO and EBO,
+ * and also one vertex array when their attributes are laid out the same. Textures
+ * are found by the hash of their file, so a copy of an image is not loaded
+ * again under another name. A hash only finds the candidates, the contents
+ * are compared before anything is shared.
+ */
+class ResourceRegistry
+{
+public:
+	struct Attribute
+	{
+		GLint location; // skipped when the shader does not use it, i.e. -1
+		GLint size; // number of floats
+		size_t offset; // bytes from the start of a vertex
+	};
+	struct Mesh
+	{
+		GLuint vertexArray;
+		GLuint vertexBuffer;
+		GLuint indexBuffer;
+		GLenum indexType; // GL_UNSIGNED_SHORT up to 65536 vertices, else GL_UNSIGNED_INT
+		GLsizei indexCount;
+	};
+
+	Mesh mesh(const GLfloat* vertices, size_t bytes, GLsizei stride, const std::vector<Attribute>& attributes);
+	GLuint texture(const char* path);
+	std::vector<GLuint> textures(const std::vector<std::string>& paths); // decoding the new ones at once
+	void report() const;
+
+	// FNV-1a, continued from seed
+	static unsigned long long hash(const void* data, size_t bytes, unsigned long long seed = 14695981039346656037ull);
+
+private:
+	struct CookedBuffers
+	{
+		std::vector<GLubyte> vertices; // the soup they were cooked from
+		Mesh mesh; // without vertex array
+	};
+	struct VertexArray
+	{
+		GLsizei stride;
+		std::vector<Attribute> attributes;
+		Mesh mesh;
+	};
+	struct LoadedTexture
+	{
+		std::string contents; // of the file
+		GLuint texture;
+	};
+	std::unordered_multimap<unsigned long long, CookedBuffers> buffers; // by hash of the vertices
+	std::unordered_multimap<unsigned long long, VertexArray> meshes; // by hash of the vertices and layout
+	std::unordered_multimap<unsigned long long, LoadedTexture> loadedTextures; // by hash of the file contents
+	size_t meshRequests = 0, textureRequests = 0;
+	size_t uploadedBytes = 0, sharedBytes = 0;
+};
+
+/**
+ * @brief Program made by InitShader with its active uniforms and attributes
+ * looked up once after linking. Uniforms are set through handles, indices
+ * into the reflected uniforms, and a value equal to the last one set is not
+ * uploaded again. Converts to the program id for the gl calls.
+ */
+class ShaderProgram
+{
+public:
+	ShaderProgram() = default;
+	explicit ShaderProgram(GLuint program);
+	operator GLuint() const { return program; }
+
+	GLint uniform(const std::string& name) const; // handle of an active uniform, -1 if there is none
+	GLint attribute(const std::string& name) const; // location of an active attribute, -1 if there is none
+
+	// upload to the uniform of handle, the program has to be in use
+	void set(GLint handle, GLint value);
+	void set(GLint handle, GLuint value);
+	void set(GLint handle, GLfloat value);
+	void set(GLint handle, const vec3& value);
+	void set(GLint handle, const mat4& value);
+
+private:
+	struct Uniform
+	{
+		GLint location;
+		bool known; // value holds what was uploaded last
+		GLubyte value[sizeof(mat4)];
+	};
+	bool changed(GLint handle, const void* value, size_t bytes);
+
+	GLuint program = 0;
+	std::vector<Uniform> uniforms;
+	std::unordered_map<std::string, GLint> uniformHandles;
+	std::unordered_map<std::string, GLint> attributeLocations;
+};
+
+/**
+ * @brief Uniform handles and attribute locations of vshader_lsystem.glsl,
+ * resolved once by init() so display() does not look names up
+ */
+struct LSystemLocations
+{
+	GLint positionScale, positionOffset, treeRotation, forestRotation; // uniforms
+	GLint vPosition, vColor; // attributes, -1 if not active
+};
+
+/**
+ * @brief Uniform handles and attribute locations of vshader_hierarchy.glsl
+ */
+struct HierarchyLocations
+{
+	GLint hierarchy, treeRotation, forestRotation, angle, steps, root, leaf; // uniforms
+	GLint vPosition, vColor; // attributes, -1 if not active
+};
+
+/**
+ * @brief Uniform handles of fshader_lightCube.glsl
+ */
+struct LightCubeLocations
+{
+	GLint objectColor, lightColor, lightPos;
 };
 
 GLuint Angel::InitShader(const char* vShaderFile, const char* fShaderFile);
-GLuint lsystemShader; /* shader lsystemShader object id */
+GLStateCache glState; /* binds and modes display() has set */
+ResourceRegistry resources; /* meshes and textures shared by content */
+RenderQueue renderQueue; /* draws of the frame display() is drawing */
+ShaderProgram lsystemShader; /* shader lsystemShader object id */
+LSystemLocations lsystem; /* uniforms and attributes of lsystemShader */
 GLuint lsystemVAO; /* vertex array object id */
 GLuint lsystemVBO; /* vertex buffer object id */
+GLuint lsystemEBO; /* element buffer object id of the line strips */
+GLuint forestVBO; /* instance buffer object id of the trees */
 
-GLuint floorVAO; /* vertex array object id for the floor */
-GLuint floorVBO; /* vertex buffer object id for floor */
+ShaderProgram hierarchyShader; /* shader object id of the hierarchical l-system */
+HierarchyLocations hierarchyLocations; /* uniforms and attributes of hierarchyShader */
+GLuint hierarchyVAO; /* vertex array object id of the leaf meshes */
+GLuint hierarchyVBO; /* vertex buffer object id of the leaf meshes */
+GLuint hierarchyEBO; /* element buffer object id of the leaf meshes */
+GLuint hierarchyTBO; /* buffer object id of the tree of moves */
+GLuint hierarchyTexture; /* buffer texture of hierarchyTBO */
+GLsizei lsystemIndexCount = 0; // number of indices in lsystemEBO, restarts included
+const GLuint restartIndex = 0xFFFFFFFFu; // ends one line strip and starts the next
 
-GLuint skyboxShader; /* shader lsystemShader object id */
-GLuint skyboxVAO; /* vertex array object id */
-GLuint skyboxVBO; /* vertex buffer object id */
+ResourceRegistry::Mesh floorMesh; /* vertex array and buffers of the floor */
+
+ShaderProgram skyboxShader; /* shader lsystemShader object id */
+ResourceRegistry::Mesh skyboxMesh; /* vertex array and buffers of the skybox */
 unsigned int cubemapTexture;
 
-GLuint cubeShader; /* shader cube object id */
-GLuint cube1VAO; /* vertex array object id */
-GLuint cube1VBO; /* vertex buffer object id */
+ShaderProgram cubeShader; /* shader cube object id */
+ResourceRegistry::Mesh cube1Mesh; /* vertex array and buffers of cube 1 */
 unsigned int cube1Texture;
-GLuint cube2VAO; /* vertex array object id */
-GLuint cube2VBO; /* vertex buffer object id */
+ResourceRegistry::Mesh cube2Mesh; /* the same as cube1Mesh, the cubes only differ in texture */
 unsigned int cube2Texture;
 
-GLuint lightCubeShader; /* shader cube object id */
-GLuint lightCubeVAO; /* vertex array object id */
-GLuint lightCubeVBO; /* vertex buffer object id */
-GLuint lightShader;
-unsigned int lightVAO;
+ShaderProgram lightCubeShader; /* shader cube object id */
+LightCubeLocations lightCube; /* uniforms of lightCubeShader */
+ResourceRegistry::Mesh lightCubeMesh; /* vertex array and buffers of the lit cube */
+ShaderProgram lightShader;
+ResourceRegistry::Mesh lightMesh; /* the buffers of lightCubeMesh with positions only */
+
+GLuint frameUBO; /* uniform buffer object id of the Frame block */
+GLuint objectUBO; /* uniform buffer object id of the Object blocks, one per ObjectSlot */
+const GLuint frameBinding = 0; // binding point of the Frame block
+const GLuint objectBinding = 1; // binding point of the Object block
+GLsizeiptr objectStride = sizeof(mat4); // bytes from one Object block to the next, a multiple of the offset alignment
+std::vector<GLubyte> objectBlocks{}; // the Object blocks of this frame before the upload
+const int vertexCacheSize = 16; // post-transform cache the meshes are ordered for, in vertices
 
 color3 color{ 0.7f, 1, 0.5f }; // l-system color (green)
 std::ifstream file{};
@@ -67,11 +650,12 @@ std::string tree{}; /* save l-system string */
 std::vector<Edge> edges{}; /* save l-system edges */
 std::vector<Memory> memories{}; /* save l-system states */
 std::map<char, std::string> grammers{}; /* save l-system rules */
-std::vector<point3> l_system_points{}; // holds all the points that construct the tree
-std::vector<color3> l_system_colors{}; // holds the color for each line
+Grammar grammar{}; /* l-system rules compiled for expansion */
+PackedAlphabet alphabet{}; /* l-system rules compiled for packed expansion */
+PackedString packedTree{}; /* save the packed l-system string */
 
-Edge gl_poped_edge;
-bool gl_poped = false;
+Memory turtle{ point3{ 0, -0.5f, 0.0 }, 0 }; // current turtle state
+HeadingTable headings{}; // edge vector of every heading of the turtle
 
 // Projection transformation parameters
 GLfloat fovy = 45.0; // Field-of-view in Y direction angle (in degrees)
@@ -80,10 +664,40 @@ GLfloat zNear = 0.5, zFar = 2.0;
 GLfloat width{1600}, height{ 800 };
 
 GLfloat angle = 0.0; // rotation angle
-GLfloat gl_angle = 0.0; // global rotation angle
 GLfloat gl_len = 0.007f; //unit length
 int generation{};
+bool benchmark = false; // run the benchmarks instead of opening the window
+bool quantized = false; // store the l-system as QVertex with a constant color (-quantize)
+vec3 lsystemScale{ 1.0f, 1.0f, 1.0f }; // dequantization of the l-system positions
+vec3 lsystemOffset{ 0.0f, 0.0f, 0.0f };
+enum class ExpansionMode
+{
+	String, // rewrite tree generation by generation
+	Stream, // expand the symbols on the fly while LSystem() runs (-stream)
+	DAG, // walk a DAG of shared sub-expansions (-dag)
+	Packed // rewrite a string of 2 or 4 bit codes generation by generation (-packed)
+};
+ExpansionMode expansionMode = ExpansionMode::String; // how the l-system string is produced
+unsigned int numThreads = std::thread::hardware_concurrency(); // worker threads for the l-system
+int leafGenerations = -1; // draw the l-system from leaves of this many generations (-hierarchy), -1 to expand it
+LSystemHierarchy hierarchy{}; // the l-system when leafGenerations >= 0
+unsigned long long memoryBudget = 4096ull << 20; // bytes the l-system may use, -budget in MB
+std::vector<LSystemSize> lsystemSizes{}; // predicted size of every generation up to generation
 
+std::vector<TreeInstance> forest{}; // trees drawn by the single instanced draw of the l-system
+bool levelsOfDetail = false; // keep every generation and draw each tree at the one its size needs (-lod)
+std::vector<LevelRange> levels{}; // generation g at levels[g - 1] with -lod
+GLfloat lodPixels = 1.0f; // smallest size in pixels of an edge before a tree drops to a lower generation
+bool culling = false; // draw every tree on its own with only the parts of it in view (-cull)
+std::vector<GLuint> lsystemIndices{}; // the line strips of lsystemEBO, kept for culling and picking
+LSystemBVH lsystemBVH{}; // bounding boxes of the edges of the l-system
+struct
+{
+	long long tree = -1; // picked tree in forest, -1 for none
+	GLuint firstIndex;
+	GLsizei indexCount;
+} picked; // branch picked with shift + left click, drawn highlighted
+int forestSize = 0; // number of trees of -forest, 0 for the three default ones
 float A = 0; // L-system mv rotation
 float AA = 0;
 float X = 0; // L system mv translation X
@@ -273,6 +887,38 @@ std::vector<std::string> faces
 int numLsystem = 3;
 std::vector<vec2> coords {};
 
+/**
+ * @brief Reads the symbols [begin, end) of tree for interpretParallel()
+ */
+struct StringReader
+{
+	template <typename Visit>
+	void operator()(size_t begin, size_t end, Visit&& visit) const
+	{
+		for (size_t i = begin; i < end; i++)
+			visit(tree[i]);
+	}
+};
+
+/**
+ * @brief Reads the symbols [begin, end) of packedTree for interpretParallel(),
+ * unpacking a block at a time
+ */
+struct PackedReader
+{
+	template <typename Visit>
+	void operator()(size_t begin, size_t end, Visit&& visit) const
+	{
+		char block[4096];
+		for (size_t i = begin; i < end; i += sizeof(block))
+		{
+			size_t count = packedTree.unpack(alphabet, i, std::min(sizeof(block), end - i), block);
+			for (size_t j = 0; j < count; j++)
+				visit(block[j]);
+		}
+	}
+};
+
 
 void init();
 void display();
@@ -281,11 +927,56 @@ void idle();
 void keyboard(unsigned char key, int x, int y);
 void onMouseClick(int button, int state, int x, int y);
 
+void parallelFor(size_t count, const std::function<void(size_t)>& body);
 void LSystemRules();
+void compileGrammar();
+std::vector<LSystemSize> predictLSystem(int generations);
+void checkMemoryBudget();
+void runBenchmarks();
 void LSystemString();
+void rewrite(const std::string& source, std::string& target);
+std::string expandTo(int generation, const std::string& symbols = axiom);
+void compileAlphabet();
+void rewritePacked(const PackedString& source, PackedString& target);
+void benchmarkPackedString();
+void benchmarkTurtle();
 void LSystem(); // store all the line points in points
+void interpret(char symbol);
+template <typename Read>
+void interpretParallel(size_t length, const Read& read);
+void benchmarkParallelTurtle();
+void benchmarkLSystemView();
+void benchmarkLSystemDAG();
 
 void createEdge();
+void buildStrips(const std::vector<Edge>& lines, const color3& tint, std::vector<LVertex>& vertices, std::vector<GLuint>& indices);
+template <typename Emit>
+size_t buildStrips(const std::vector<Edge>& lines, std::vector<GLuint>& indices, Emit emit);
+size_t stripVertexBound(const std::vector<Edge>& lines);
+void quantizeVertices(const std::vector<LVertex>& vertices, std::vector<QVertex>& out, vec3& scale, vec3& offset);
+void fitQuantization(const vec2& low, const vec2& high, vec3& scale, vec3& offset);
+QVertex quantize(const point3& position, const vec3& scale, const vec3& offset);
+void plantForest();
+mat4 treeModel(const TreeInstance& tree);
+void drawCulled(const mat4& model_view, const mat4& projection);
+void pickBranch(int x, int y);
+void benchmarkCulling();
+void buildLevels(std::vector<LVertex>& vertices, std::vector<GLuint>& indices);
+void drawLevels(const mat4& model_view);
+void initUniformBlocks(const std::vector<GLuint>& programs);
+void uploadUniformBlocks(const FrameBlock& frame, const mat4 (&models)[ObjectCount]);
+void bindObject(ObjectSlot slot);
+void cookMesh(const GLfloat* soup, size_t floatsPerVertex, size_t vertexCount, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices,
+	GLfloat* weldedMisses = nullptr, GLfloat* cookedMisses = nullptr);
+void weldVertices(const GLfloat* soup, size_t floatsPerVertex, size_t vertexCount, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices);
+void reorderTriangles(std::vector<GLuint>& indices, size_t vertexCount, int cacheSize);
+void reorderVertices(std::vector<GLfloat>& vertices, size_t floatsPerVertex, std::vector<GLuint>& indices);
+GLfloat cacheMissRatio(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize);
+void benchmarkMeshCooking();
+void drawTrees(const mat4& model_view, const mat4& projection);
+DrawPacket meshPacket(GLuint program, const ResourceRegistry::Mesh& mesh, GLenum textureTarget, GLuint texture, ObjectSlot object,
+	GLenum depthFunc, std::function<void()> setup = nullptr);
+size_t simplifyEdges(std::vector<Edge>& lines);
 void rotateLeft();
 void rotateRight();
 void push();
@@ -308,6 +999,65 @@ int main(int argc, char** argv)
 		std::cerr << "The rule file is not founded!" << std::endl;
 		return 1;
 	}
+	/* Read the optional flags after the rule file */
+	for (int i = 6; i < argc; i++)
+	{
+		std::string option{ argv[i] };
+		if (option == "-bench")
+		{
+			benchmark = true;
+		}
+		else if (option == "-stream")
+		{
+			expansionMode = ExpansionMode::Stream;
+		}
+		else if (option == "-dag")
+		{
+			expansionMode = ExpansionMode::DAG;
+		}
+		else if (option == "-packed")
+		{
+			expansionMode = ExpansionMode::Packed;
+		}
+		else if (option == "-quantize")
+		{
+			quantized = true;
+		}
+		else if (option == "-forest" && i + 1 < argc)
+		{
+			forestSize = std::stoi(argv[++i]);
+		}
+		else if (option == "-cull")
+		{
+			culling = true;
+		}
+		else if (option == "-lod")
+		{
+			levelsOfDetail = true;
+		}
+		else if (option == "-hierarchy" && i + 1 < argc)
+		{
+			leafGenerations = std::stoi(argv[++i]);
+		}
+		else if (option == "-threads" && i + 1 < argc)
+		{
+			numThreads = std::stoi(argv[++i]);
+		}
+		else if (option == "-budget" && i + 1 < argc)
+		{
+			memoryBudget = std::stoull(argv[++i]) << 20;
+		}
+		else
+		{
+			std::cerr << "Unknown option " << option << " is ignored" << std::endl;
+		}
+	}
+
+	if (benchmark)
+	{
+		runBenchmarks();
+		return 0;
+	}
 
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
@@ -336,21 +1086,64 @@ int main(int argc, char** argv)
 	return 0;
 }
 
+/**
+ * @brief Decode the files of images on a pool of up to numThreads workers,
+ * each taking the next image left, and report the time of every image
+ */
+void decodeImages(std::vector<DecodedImage>& images)
+{
+	std::atomic<size_t> next{ 0 };
+	auto work = [&]()
+	{
+		for (size_t i = next++; i < images.size(); i = next++)
+		{
+			DecodedImage& image = images[i];
+			auto start = std::chrono::steady_clock::now();
+			if (image.file)
+				image.data = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(image.file->data()), (int)image.file->size(),
+					&image.width, &image.height, &image.channels, 0);
+			else
+				image.data = stbi_load(image.path.c_str(), &image.width, &image.height, &image.channels, 0);
+			image.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+	};
+	size_t workers = std::min<size_t>(std::max(numThreads, 1u), images.size());
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t w = 1; w < workers; w++)
+		threads.emplace_back(work);
+	work();
+	for (auto& thread : threads)
+		thread.join();
+	double total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	double serial = 0.0;
+	for (auto& image : images)
+	{
+		printf("Decoded %s : %dx%d in %.1f ms\n", image.path.c_str(), image.width, image.height, image.milliseconds);
+		serial += image.milliseconds;
+	}
+	printf("Decoded %zu images in %.1f ms on %zu threads (%.1f ms one after the other)\n", images.size(), total, workers, serial);
+}
+
 unsigned int loadCubemap(std::vector<std::string> faces)
 {
 	unsigned int textureID;
 	glGenTextures(1, &textureID);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
 
-	int width, height, nrChannels;
-	for (unsigned int i = 0; i < faces.size(); i++)
+	// decode the faces at once, then upload them in order here on the GL thread
+	std::vector<DecodedImage> images(faces.size());
+	for (size_t i = 0; i < faces.size(); i++)
+		images[i].path = faces[i];
+	decodeImages(images);
+	for (unsigned int i = 0; i < images.size(); i++)
 	{
-		unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
+		unsigned char* data = images[i].data;
 		if (data)
 		{
 			// note: GL_TEXTURE_CUBE_MAP_POSITIVE_X + i => enum through
 			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-			             0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
+			             0, GL_RGB, images[i].width, images[i].height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
 			);
 			stbi_image_free(data);
 		}
@@ -369,512 +1162,3709 @@ unsigned int loadCubemap(std::vector<std::string> faces)
 	return textureID;
 }
 
-unsigned int loadTexture(char const* path)
+/**
+ * @brief 2D texture of every file of paths, decoded at once and uploaded in order
+ * @param files the contents of paths if the caller read them already, empty
+ * ones are read from disk
+ */
+std::vector<unsigned int> loadTextures(const std::vector<std::string>& paths, const std::vector<std::string>& files)
 {
-	unsigned int textureID;
-	glGenTextures(1, &textureID);
+	std::vector<DecodedImage> images(paths.size());
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		images[i].path = paths[i];
+		if (i < files.size() && !files[i].empty())
+			images[i].file = &files[i];
+	}
+	decodeImages(images);
 
-	int width, height, nrComponents;
-	unsigned char* data = stbi_load(path, &width, &height, &nrComponents, 0);
-	if (data)
+	std::vector<unsigned int> textureIDs(paths.size());
+	for (size_t i = 0; i < images.size(); i++)
 	{
-		GLenum format;
-		if (nrComponents == 1)
-			format = GL_RED;
-		else if (nrComponents == 3)
-			format = GL_RGB;
-		else if (nrComponents == 4)
-			format = GL_RGBA;
+		unsigned int textureID;
+		glGenTextures(1, &textureID);
 
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
+		unsigned char* data = images[i].data;
+		if (data)
+		{
+			GLenum format;
+			if (images[i].channels == 1)
+				format = GL_RED;
+			else if (images[i].channels == 3)
+				format = GL_RGB;
+			else if (images[i].channels == 4)
+				format = GL_RGBA;
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glBindTexture(GL_TEXTURE_2D, textureID);
+			glTexImage2D(GL_TEXTURE_2D, 0, format, images[i].width, images[i].height, 0, format, GL_UNSIGNED_BYTE, data);
+			glGenerateMipmap(GL_TEXTURE_2D);
 
-		stbi_image_free(data);
-	}
-	else
-	{
-		std::cout << "Texture failed to load at path: " << path << std::endl;
-		stbi_image_free(data);
-	}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	return textureID;
+			stbi_image_free(data);
+		}
+		else
+		{
+			std::cout << "Texture failed to load at path: " << paths[i] << std::endl;
+			stbi_image_free(data);
+		}
+		textureIDs[i] = textureID;
+	}
+	return textureIDs;
+}
+
+unsigned int loadTexture(char const* path)
+{
+	return loadTextures({ path }, {})[0];
+}
+
+unsigned long long ResourceRegistry::hash(const void* data, size_t bytes, unsigned long long seed)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < bytes; i++)
+		seed = (seed ^ p[i]) * 1099511628211ull;
+	return seed;
+}
+
+/**
+ * @brief Vertex array of the triangle soup vertices with attributes over
+ * stride bytes per vertex, cooking and uploading it only if no other mesh
+ * has the same vertices
+ */
+ResourceRegistry::Mesh ResourceRegistry::mesh(const GLfloat* vertices, size_t bytes, GLsizei stride, const std::vector<Attribute>& attributes)
+{
+	meshRequests++;
+	unsigned long long vertexKey = hash(&bytes, sizeof(bytes), hash(vertices, bytes));
+	unsigned long long layoutKey = hash(&stride, sizeof(stride), vertexKey);
+	for (auto& attribute : attributes)
+	{
+		layoutKey = hash(&attribute.location, sizeof(attribute.location), layoutKey);
+		layoutKey = hash(&attribute.size, sizeof(attribute.size), layoutKey);
+		layoutKey = hash(&attribute.offset, sizeof(attribute.offset), layoutKey);
+	}
+	const CookedBuffers* cooked = nullptr;
+	auto sameBuffers = buffers.equal_range(vertexKey);
+	for (auto entry = sameBuffers.first; entry != sameBuffers.second && !cooked; ++entry)
+		if (entry->second.vertices.size() == bytes && std::memcmp(entry->second.vertices.data(), vertices, bytes) == 0)
+			cooked = &entry->second;
+	if (cooked)
+	{
+		// the same vertices, and so the same buffers, also need the same layout
+		auto sameLayout = [&](const VertexArray& array)
+		{
+			if (array.mesh.vertexBuffer != cooked->mesh.vertexBuffer || array.stride != stride || array.attributes.size() != attributes.size())
+				return false;
+			for (size_t i = 0; i < attributes.size(); i++)
+				if (array.attributes[i].location != attributes[i].location || array.attributes[i].size != attributes[i].size
+					|| array.attributes[i].offset != attributes[i].offset)
+					return false;
+			return true;
+		};
+		auto sameArrays = meshes.equal_range(layoutKey);
+		for (auto entry = sameArrays.first; entry != sameArrays.second; ++entry)
+			if (sameLayout(entry->second))
+			{
+				sharedBytes += bytes;
+				return entry->second.mesh;
+			}
+	}
+
+	Mesh mesh{};
+	if (cooked)
+	{
+		mesh = cooked->mesh;
+		sharedBytes += bytes;
+	}
+	else
+	{
+		size_t floatsPerVertex = stride / sizeof(GLfloat);
+		size_t vertexCount = bytes / stride;
+		std::vector<GLfloat> welded;
+		std::vector<GLuint> indices;
+		GLfloat weldedMisses, cookedMisses;
+		cookMesh(vertices, floatsPerVertex, vertexCount, welded, indices, &weldedMisses, &cookedMisses);
+		size_t weldedCount = welded.size() / floatsPerVertex;
+		printf("Mesh : %zu vertices welded to %zu, %.2f cache misses per triangle reordered to %.2f\n",
+			vertexCount, weldedCount, weldedMisses, cookedMisses);
+
+		glGenBuffers(1, &mesh.vertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * welded.size(), welded.data(), GL_STATIC_DRAW);
+		glGenBuffers(1, &mesh.indexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+		mesh.indexCount = (GLsizei)indices.size();
+		if (weldedCount <= 0x10000)
+		{
+			std::vector<GLushort> shortIndices(indices.begin(), indices.end());
+			mesh.indexType = GL_UNSIGNED_SHORT;
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * shortIndices.size(), shortIndices.data(), GL_STATIC_DRAW);
+			uploadedBytes += sizeof(GLushort) * shortIndices.size();
+		}
+		else
+		{
+			mesh.indexType = GL_UNSIGNED_INT;
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.data(), GL_STATIC_DRAW);
+			uploadedBytes += sizeof(GLuint) * indices.size();
+		}
+		uploadedBytes += sizeof(GLfloat) * welded.size();
+		const GLubyte* soup = reinterpret_cast<const GLubyte*>(vertices);
+		buffers.emplace(vertexKey, CookedBuffers{ std::vector<GLubyte>(soup, soup + bytes), mesh });
+	}
+	glGenVertexArrays(1, &mesh.vertexArray);
+	glBindVertexArray(mesh.vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+	for (auto& attribute : attributes)
+	{
+		if (attribute.location < 0)
+			continue;
+		glEnableVertexAttribArray(attribute.location);
+		glVertexAttribPointer(attribute.location, attribute.size, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(attribute.offset));
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	meshes.emplace(layoutKey, VertexArray{ stride, attributes, mesh });
+	return mesh;
+}
+
+/**
+ * @brief loadTexture(path), or the texture of a file with the same contents
+ */
+GLuint ResourceRegistry::texture(const char* path)
+{
+	return textures({ path })[0];
+}
+
+/**
+ * @brief The textures of paths, loading the files whose contents are new
+ * with one loadTextures so they decode in parallel. Every file is read once,
+ * the decoders get the contents it was hashed and compared by.
+ */
+std::vector<GLuint> ResourceRegistry::textures(const std::vector<std::string>& paths)
+{
+	textureRequests += paths.size();
+	std::vector<GLuint> result(paths.size(), 0);
+	// the files loaded now, once per contents
+	std::vector<std::string> newPaths, newContents;
+	std::vector<unsigned long long> newKeys;
+	std::vector<size_t> newOf(paths.size(), SIZE_MAX); // index in newPaths, unless already loaded
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		std::ifstream image{ paths[i], std::ios::binary };
+		std::string contents{ std::istreambuf_iterator<char>(image), std::istreambuf_iterator<char>() };
+		unsigned long long key = hash(contents.data(), contents.size());
+		// unreadable files go to loadTextures too, which reports them, the others are decoded from contents
+		if (!contents.empty())
+		{
+			auto same = loadedTextures.equal_range(key);
+			for (auto entry = same.first; entry != same.second && result[i] == 0; ++entry)
+				if (entry->second.contents == contents)
+					result[i] = entry->second.texture;
+			for (size_t n = 0; n < newPaths.size() && result[i] == 0 && newOf[i] == SIZE_MAX; n++)
+				if (newKeys[n] == key && newContents[n] == contents)
+					newOf[i] = n;
+		}
+		if (result[i] == 0 && newOf[i] == SIZE_MAX)
+		{
+			newOf[i] = newPaths.size();
+			newPaths.push_back(paths[i]);
+			newContents.push_back(std::move(contents));
+			newKeys.push_back(key);
+		}
+	}
+	std::vector<unsigned int> loaded = loadTextures(newPaths, newContents);
+	for (size_t i = 0; i < paths.size(); i++)
+		if (newOf[i] != SIZE_MAX)
+			result[i] = loaded[newOf[i]];
+	for (size_t n = 0; n < newPaths.size(); n++)
+		if (!newContents[n].empty())
+			loadedTextures.emplace(newKeys[n], LoadedTexture{ std::move(newContents[n]), loaded[n] });
+	return result;
+}
+
+void ResourceRegistry::report() const
+{
+	printf("Resources : %zu meshes from %zu vertex buffers and %zu vertex arrays (%zu bytes uploaded, %zu bytes shared), %zu textures from %zu images\n",
+		meshRequests, buffers.size(), meshes.size(), uploadedBytes, sharedBytes, textureRequests, loadedTextures.size());
+}
+
+
+/**
+ * @brief Turn the triangle soup of vertexCount vertices of floatsPerVertex
+ * floats into welded vertices and triangle indices, the triangles ordered
+ * for the post-transform vertex cache and the vertices in order of first use.
+ * Every step is linear in the size of the soup. weldedMisses and cookedMisses
+ * get the cache misses per triangle before and after the reordering.
+ */
+void cookMesh(const GLfloat* soup, size_t floatsPerVertex, size_t vertexCount, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices,
+	GLfloat* weldedMisses, GLfloat* cookedMisses)
+{
+	weldVertices(soup, floatsPerVertex, vertexCount, vertices, indices);
+	size_t weldedCount = vertices.size() / floatsPerVertex;
+	if (weldedMisses)
+		*weldedMisses = cacheMissRatio(indices, weldedCount, vertexCacheSize);
+	reorderTriangles(indices, weldedCount, vertexCacheSize);
+	if (cookedMisses)
+		*cookedMisses = cacheMissRatio(indices, weldedCount, vertexCacheSize);
+	reorderVertices(vertices, floatsPerVertex, indices);
+}
+
+/**
+ * @brief Keep one of every run of identical vertices, bit for bit, found
+ * through an open addressing table of the vertex hashes
+ */
+void weldVertices(const GLfloat* soup, size_t floatsPerVertex, size_t vertexCount, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices)
+{
+	const GLuint empty = 0xFFFFFFFFu;
+	const size_t bytes = sizeof(GLfloat) * floatsPerVertex;
+	size_t tableSize = 1;
+	while (tableSize < 2 * vertexCount)
+		tableSize <<= 1;
+	std::vector<GLuint> table(tableSize, empty);
+	vertices.clear();
+	vertices.reserve(floatsPerVertex * vertexCount);
+	indices.resize(vertexCount);
+	for (size_t i = 0; i < vertexCount; i++)
+	{
+		const GLfloat* vertex = soup + i * floatsPerVertex;
+		size_t slot = ResourceRegistry::hash(vertex, bytes) & (tableSize - 1);
+		while (table[slot] != empty && std::memcmp(&vertices[table[slot] * floatsPerVertex], vertex, bytes) != 0)
+			slot = (slot + 1) & (tableSize - 1);
+		if (table[slot] == empty)
+		{
+			table[slot] = (GLuint)(vertices.size() / floatsPerVertex);
+			vertices.insert(vertices.end(), vertex, vertex + floatsPerVertex);
+		}
+		indices[i] = table[slot];
+	}
+}
+
+/**
+ * @brief Order the triangles for a FIFO vertex cache of cacheSize vertices
+ * like Tipsify (Sander, Nehab and Barczak 2007): emit the triangles left
+ * around a vertex, then go on from the vertex of those that stays in the
+ * cache longest while its own triangles are emitted, or from the last
+ * vertex with triangles left when none does
+ */
+void reorderTriangles(std::vector<GLuint>& indices, size_t vertexCount, int cacheSize)
+{
+	// triangles around every vertex, by counting sort
+	std::vector<GLuint> offsets(vertexCount + 1, 0);
+	for (GLuint v : indices)
+		offsets[v + 1]++;
+	for (size_t v = 0; v < vertexCount; v++)
+		offsets[v + 1] += offsets[v];
+	std::vector<GLuint> adjacency(indices.size());
+	std::vector<GLuint> live(vertexCount); // triangles left around the vertex
+	{
+		std::vector<GLuint> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++)
+			adjacency[fill[indices[i]]++] = (GLuint)(i / 3);
+		for (size_t v = 0; v < vertexCount; v++)
+			live[v] = offsets[v + 1] - offsets[v];
+	}
+
+	std::vector<size_t> stamp(vertexCount, 0); // time the vertex went into the cache
+	std::vector<char> emitted(indices.size() / 3, 0);
+	std::vector<GLuint> deadEnd, candidates, order;
+	order.reserve(indices.size());
+	size_t time = cacheSize + 1;
+	size_t cursor = 0;
+	long long fan = vertexCount > 0 ? 0 : -1;
+	while (fan >= 0)
+	{
+		candidates.clear();
+		for (GLuint a = offsets[fan]; a < offsets[fan + 1]; a++)
+		{
+			GLuint t = adjacency[a];
+			if (emitted[t])
+				continue;
+			emitted[t] = 1;
+			for (int k = 0; k < 3; k++)
+			{
+				GLuint v = indices[3 * t + k];
+				order.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - stamp[v] > (size_t)cacheSize)
+					stamp[v] = time++;
+			}
+		}
+		fan = -1;
+		long long best = -1;
+		for (GLuint v : candidates)
+		{
+			if (live[v] == 0)
+				continue;
+			size_t age = time - stamp[v];
+			long long priority = age + 2 * live[v] <= (size_t)cacheSize ? (long long)age : 0;
+			if (priority > best)
+			{
+				best = priority;
+				fan = v;
+			}
+		}
+		while (fan < 0 && !deadEnd.empty())
+		{
+			GLuint v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0)
+				fan = v;
+		}
+		for (; fan < 0 && cursor < vertexCount; cursor++)
+			if (live[cursor] > 0)
+				fan = cursor;
+	}
+	indices.swap(order);
+}
+
+/**
+ * @brief Number the vertices in the order the indices first use them
+ */
+void reorderVertices(std::vector<GLfloat>& vertices, size_t floatsPerVertex, std::vector<GLuint>& indices)
+{
+	const GLuint unused = 0xFFFFFFFFu;
+	std::vector<GLuint> remap(vertices.size() / floatsPerVertex, unused);
+	std::vector<GLfloat> ordered(vertices.size());
+	GLuint next = 0;
+	for (GLuint& index : indices)
+	{
+		if (remap[index] == unused)
+		{
+			std::copy_n(&vertices[index * floatsPerVertex], floatsPerVertex, &ordered[next * floatsPerVertex]);
+			remap[index] = next++;
+		}
+		index = remap[index];
+	}
+	ordered.resize(next * floatsPerVertex);
+	vertices.swap(ordered);
+}
+
+/**
+ * @brief Vertices transformed per triangle of indices with a FIFO cache of cacheSize
+ */
+GLfloat cacheMissRatio(const std::vector<GLuint>& indices, size_t vertexCount, int cacheSize)
+{
+	if (indices.empty())
+		return 0.0f;
+	std::vector<size_t> stamp(vertexCount, 0);
+	size_t time = cacheSize + 1, misses = 0;
+	for (GLuint v : indices)
+		if (time - stamp[v] > (size_t)cacheSize)
+		{
+			stamp[v] = time++;
+			misses++;
+		}
+	return (GLfloat)misses / (indices.size() / 3);
+}
+
+bool GLStateCache::count(bool redundant)
+{
+	if (redundant)
+		skipped++;
+	else
+		issued++;
+	return !redundant;
+}
+
+void GLStateCache::useProgram(GLuint id)
+{
+	if (count(program == id))
+		glUseProgram(program = id);
+}
+
+void GLStateCache::bindVertexArray(GLuint id)
+{
+	if (count(vertexArray == id))
+		glBindVertexArray(vertexArray = id);
+}
+
+int GLStateCache::targetIndex(GLenum target)
+{
+	switch (target)
+	{
+	case GL_TEXTURE_2D: return 0;
+	case GL_TEXTURE_CUBE_MAP: return 1;
+	case GL_TEXTURE_BUFFER: return 2;
+	default: return -1;
+	}
+}
+
+void GLStateCache::bindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+	int index = targetIndex(target);
+	GLuint* bound = unit < (GLuint)maxUnits && index >= 0 ? &textures[unit][index] : nullptr;
+	if (bound && *bound == texture)
+	{
+		count(true);
+		return;
+	}
+	if (count(activeUnit == unit))
+		glActiveTexture(GL_TEXTURE0 + (activeUnit = unit));
+	count(false);
+	glBindTexture(target, texture);
+	if (bound)
+		*bound = texture;
+}
+
+void GLStateCache::depthFunc(GLenum func)
+{
+	if (count(depth == func))
+		glDepthFunc(depth = func);
+}
+
+void GLStateCache::polygonMode(GLenum mode)
+{
+	if (count(polygon == mode))
+		glPolygonMode(GL_FRONT_AND_BACK, polygon = mode);
+}
+
+void GLStateCache::invalidate()
+{
+	program = vertexArray = activeUnit = unknown;
+	depth = polygon = unknown;
+	std::fill(&textures[0][0], &textures[0][0] + maxUnits * 3, unknown);
+}
+
+void GLStateCache::endFrame()
+{
+	lastIssued = issued;
+	lastSkipped = skipped;
+	issued = skipped = 0;
+}
+
+/**
+ * @brief Look up the active uniforms and attributes of program
+ */
+ShaderProgram::ShaderProgram(GLuint program)
+	: program(program)
+{
+	GLint count = 0, length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &length);
+	std::vector<GLchar> name(std::max(length, 1));
+	for (GLint i = 0; i < count; i++)
+	{
+		GLint size;
+		GLenum type;
+		glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+		GLint location = glGetUniformLocation(program, name.data());
+		if (location < 0)
+			continue; // in a uniform block
+		std::string key{ name.data() };
+		if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+			key.resize(key.size() - 3); // arrays answer to their plain name too
+		uniformHandles[key] = (GLint)uniforms.size();
+		uniforms.push_back(Uniform{ location, false, {} });
+	}
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &length);
+	name.assign(std::max(length, 1), '\0');
+	for (GLint i = 0; i < count; i++)
+	{
+		GLint size;
+		GLenum type;
+		glGetActiveAttrib(program, (GLuint)i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+		GLint location = glGetAttribLocation(program, name.data());
+		if (location >= 0)
+			attributeLocations[name.data()] = location;
+	}
+}
+
+GLint ShaderProgram::uniform(const std::string& name) const
+{
+	auto found = uniformHandles.find(name);
+	return found == uniformHandles.end() ? -1 : found->second;
+}
+
+GLint ShaderProgram::attribute(const std::string& name) const
+{
+	auto found = attributeLocations.find(name);
+	return found == attributeLocations.end() ? -1 : found->second;
+}
+
+/**
+ * @brief Remember value as the one of handle, false if it already was
+ */
+bool ShaderProgram::changed(GLint handle, const void* value, size_t bytes)
+{
+	if (handle < 0)
+		return false;
+	Uniform& uniform = uniforms[handle];
+	if (!glState.count(uniform.known && std::memcmp(uniform.value, value, bytes) == 0))
+		return false;
+	std::memcpy(uniform.value, value, bytes);
+	uniform.known = true;
+	return true;
+}
+
+void ShaderProgram::set(GLint handle, GLint value)
+{
+	if (changed(handle, &value, sizeof(value)))
+		glUniform1i(uniforms[handle].location, value);
+}
+
+void ShaderProgram::set(GLint handle, GLuint value)
+{
+	if (changed(handle, &value, sizeof(value)))
+		glUniform1ui(uniforms[handle].location, value);
+}
+
+void ShaderProgram::set(GLint handle, GLfloat value)
+{
+	if (changed(handle, &value, sizeof(value)))
+		glUniform1f(uniforms[handle].location, value);
+}
+
+void ShaderProgram::set(GLint handle, const vec3& value)
+{
+	if (changed(handle, &value, sizeof(value)))
+		glUniform3fv(uniforms[handle].location, 1, value);
+}
+
+void ShaderProgram::set(GLint handle, const mat4& value)
+{
+	if (changed(handle, &value, sizeof(value)))
+		glUniformMatrix4fv(uniforms[handle].location, 1, GL_TRUE, value);
+}
+
+/**
+ * @brief Create frameUBO and objectUBO and bind the uniform blocks Frame and
+ * Object of every program to them. The Object blocks sit objectStride apart,
+ * rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT for glBindBufferRange.
+ */
+void initUniformBlocks(const std::vector<GLuint>& programs)
+{
+	GLint alignment = 1;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	objectStride = (sizeof(mat4) + alignment - 1) / alignment * alignment;
+	objectBlocks.assign(objectStride * ObjectCount, 0);
+
+	glGenBuffers(1, &frameUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, frameBinding, frameUBO);
+	glGenBuffers(1, &objectUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, objectUBO);
+	glBufferData(GL_UNIFORM_BUFFER, objectBlocks.size(), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	for (GLuint program : programs)
+	{
+		GLuint frame = glGetUniformBlockIndex(program, "Frame");
+		if (frame != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, frame, frameBinding);
+		GLuint object = glGetUniformBlockIndex(program, "Object");
+		if (object != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, object, objectBinding);
+	}
+}
+
+/**
+ * @brief Write the Frame block and the Object block of every slot, one upload each
+ */
+void uploadUniformBlocks(const FrameBlock& frame, const mat4 (&models)[ObjectCount])
+{
+	glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameBlock), &frame);
+	for (int slot = 0; slot < ObjectCount; slot++)
+		std::memcpy(&objectBlocks[slot * objectStride], &models[slot], sizeof(mat4));
+	glBindBuffer(GL_UNIFORM_BUFFER, objectUBO);
+	glBufferData(GL_UNIFORM_BUFFER, objectBlocks.size(), NULL, GL_DYNAMIC_DRAW); // orphan last frame's blocks
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, objectBlocks.size(), objectBlocks.data());
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/**
+ * @brief Point the Object block of the following draws at the model matrix of slot
+ */
+void bindObject(ObjectSlot slot)
+{
+	glBindBufferRange(GL_UNIFORM_BUFFER, objectBinding, objectUBO, slot * objectStride, sizeof(mat4));
+}
+
+/**
+ * @brief Packet drawing the triangles of mesh, after setup sets the
+ * uniforms and attributes the shared state does not cover
+ */
+DrawPacket meshPacket(GLuint program, const ResourceRegistry::Mesh& mesh, GLenum textureTarget, GLuint texture, ObjectSlot object,
+	GLenum depthFunc, std::function<void()> setup)
+{
+	GLsizei count = mesh.indexCount;
+	GLenum indexType = mesh.indexType;
+	return DrawPacket{ program, mesh.vertexArray, textureTarget, texture, object, depthFunc, [count, indexType, setup]()
+		{
+			if (setup)
+				setup();
+			glDrawElements(GL_TRIANGLES, count, indexType, BUFFER_OFFSET(0));
+		} };
+}
+
+/**
+ * @brief From high to low bits : pass (4), program (12), texture (12),
+ * vertex array (12) and depth (24), the depth scaled from 0 to zFar
+ */
+unsigned long long RenderQueue::sortKey(RenderPass pass, const DrawPacket& packet, GLfloat depth)
+{
+	GLfloat unit = std::min(std::max(depth / zFar, 0.0f), 1.0f);
+	return (unsigned long long)(pass & 0xF) << 60
+		| (unsigned long long)(packet.program & 0xFFF) << 48
+		| (unsigned long long)(packet.texture & 0xFFF) << 36
+		| (unsigned long long)(packet.vertexArray & 0xFFF) << 24
+		| (unsigned long long)(unit * 0xFFFFFF);
+}
+
+void RenderQueue::submit(RenderPass pass, GLfloat depth, DrawPacket packet)
+{
+	entries.push_back(Entry{ sortKey(pass, packet, depth), (GLuint)packets.size() });
+	packets.push_back(std::move(packet));
+}
+
+void RenderQueue::sort()
+{
+	scratch.resize(entries.size());
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t counts[256] = {};
+		for (auto& entry : entries)
+			counts[(entry.key >> shift) & 0xFF]++;
+		if (counts[(entries[0].key >> shift) & 0xFF] == entries.size())
+			continue; // every key has the same byte here
+		size_t offset = 0;
+		for (size_t& count : counts)
+		{
+			size_t n = count;
+			count = offset;
+			offset += n;
+		}
+		for (auto& entry : entries)
+			scratch[counts[(entry.key >> shift) & 0xFF]++] = entry;
+		entries.swap(scratch);
+	}
+}
+
+void RenderQueue::execute()
+{
+	if (!entries.empty())
+		sort();
+	for (auto& entry : entries)
+	{
+		const DrawPacket& packet = packets[entry.packet];
+		glState.useProgram(packet.program);
+		glState.depthFunc(packet.depthFunc);
+		bindObject(packet.object);
+		glState.bindVertexArray(packet.vertexArray);
+		if (packet.textureTarget != 0)
+			glState.bindTexture(0, packet.textureTarget, packet.texture);
+		packet.draw();
+	}
+	packets.clear();
+	entries.clear();
+}
+
+
+void init()
+{
+	// Load shaders and create a shader lsystemShader (to be used in display())
+	lsystemShader = ShaderProgram{ InitShader("vshader_lsystem.glsl", "fshader_lsystem.glsl") };
+	skyboxShader = ShaderProgram{ InitShader("vshader_skybox.glsl", "fshader_skybox.glsl") };
+	cubeShader = ShaderProgram{ InitShader("vshader_cube.glsl", "fshader_cube.glsl") };
+	lightCubeShader = ShaderProgram{ InitShader("vshader_lightCube.glsl", "fshader_lightCube.glsl") };
+	lightShader = ShaderProgram{ InitShader("vshader_light.glsl", "fshader_light.glsl") };
+	hierarchyShader = ShaderProgram{ InitShader("vshader_hierarchy.glsl", "fshader_lsystem.glsl") };
+	// the handles display() sets uniforms and constant attributes through
+	lsystem = LSystemLocations{ lsystemShader.uniform("positionScale"), lsystemShader.uniform("positionOffset"),
+		lsystemShader.uniform("treeRotation"), lsystemShader.uniform("forestRotation"),
+		lsystemShader.attribute("vPosition"), lsystemShader.attribute("vColor") };
+	hierarchyLocations = HierarchyLocations{ hierarchyShader.uniform("hierarchy"), hierarchyShader.uniform("treeRotation"),
+		hierarchyShader.uniform("forestRotation"), hierarchyShader.uniform("angle"), hierarchyShader.uniform("steps"),
+		hierarchyShader.uniform("root"), hierarchyShader.uniform("leaf"),
+		hierarchyShader.attribute("vPosition"), hierarchyShader.attribute("vColor") };
+	lightCube = LightCubeLocations{ lightCubeShader.uniform("objectColor"), lightCubeShader.uniform("lightColor"),
+		lightCubeShader.uniform("lightPos") };
+	// Share the Frame and Object uniform blocks between all of them
+	initUniformBlocks({ lsystemShader, skyboxShader, cubeShader, lightCubeShader, lightShader, hierarchyShader });
+
+
+	// Initialize the l-system rules
+	LSystemRules();
+	// Predict the size of the l-system before expanding it
+	lsystemSizes = predictLSystem(generation);
+	if (leafGenerations >= 0)
+	{
+		// only the leaves are expanded, so the size of generation N does not matter
+		headings.reset(angle, gl_len);
+		hierarchy = LSystemHierarchy{ generation, leafGenerations };
+		if (!hierarchy.valid)
+		{
+			std::cout << "The l-system can not be drawn from leaves, expanding it" << std::endl;
+			leafGenerations = -1;
+		}
+		else if (levelsOfDetail || culling || quantized)
+		{
+			std::cout << "-lod, -cull and -quantize do not work with -hierarchy, the leaves are drawn without them" << std::endl;
+			levelsOfDetail = culling = quantized = false;
+		}
+	}
+	if (leafGenerations < 0 && levelsOfDetail)
+	{
+		// buildLevels() expands every generation up to the finest one itself
+		checkMemoryBudget();
+		if (culling)
+		{
+			std::cout << "-cull does not work with -lod, the levels of detail are drawn without culling" << std::endl;
+			culling = false;
+		}
+	}
+	if (leafGenerations < 0 && !levelsOfDetail)
+	{
+		checkMemoryBudget();
+		// Initialize the l-system string
+		LSystemString();
+		// Initialize the vertex data for the gl_len-system
+		LSystem();
+		simplifyEdges(edges);
+	}
+
+	// Initialize the vertex data for the floor
+	floor();
+	// Interleave it into a triangle soup for the mesh pipeline, which makes the VAO
+	LVertex floorVertices[floor_NumVertices];
+	for (int i = 0; i < floor_NumVertices; i++)
+		floorVertices[i] = LVertex{ floor_points[i], floor_colors[i] };
+	floorMesh = resources.mesh(&floorVertices[0].position.x, sizeof(floorVertices), sizeof(LVertex), {
+		{ lsystem.vPosition, 3, offsetof(LVertex, position) },
+		{ lsystem.vColor, 3, offsetof(LVertex, color) } });
+
+	plantForest();
+	// the vertex array of the expanded l-system, the hierarchy draws from its own
+	if (leafGenerations < 0)
+	{
+		// Step 1: Generate and bind the VAO for the lines
+		glGenVertexArrays(1, &lsystemVAO);
+		glBindVertexArray(lsystemVAO);
+		// Step 2: Generate the VBO for the lines
+		glGenBuffers(1, &lsystemVBO);
+		// Step 3: Bind the VBO with the GL_ARRAY_BUFFER buffer type
+		glBindBuffer(GL_ARRAY_BUFFER, lsystemVBO);
+		// Step 4: Write the vertex data into the VBO, every branch is a line strip of shared vertices
+		{
+			std::vector<GLuint> indices;
+			size_t vertexCount;
+			if (levelsOfDetail)
+			{
+				std::vector<LVertex> vertices;
+				buildLevels(vertices, indices);
+				vertexCount = vertices.size();
+				if (quantized)
+				{
+					std::vector<QVertex> compact;
+					quantizeVertices(vertices, compact, lsystemScale, lsystemOffset);
+					glBufferData(GL_ARRAY_BUFFER, sizeof(QVertex) * compact.size(), compact.data(), GL_STATIC_DRAW);
+				}
+				else
+					glBufferData(GL_ARRAY_BUFFER, sizeof(LVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+			}
+			else
+			{
+				// the strips go straight into the mapped VBO, made for the most vertices they can have
+				size_t bound = std::max<size_t>(stripVertexBound(edges), 1);
+				size_t vertexSize = quantized ? sizeof(QVertex) : sizeof(LVertex);
+				glBufferData(GL_ARRAY_BUFFER, vertexSize * bound, nullptr, GL_STATIC_DRAW);
+				void* mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexSize * bound, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+				if (quantized)
+				{
+					// the strip vertices are the end points of the edges, so their box is the one of the edges
+					vec2 low{ FLT_MAX, FLT_MAX }, high{ -FLT_MAX, -FLT_MAX };
+					for (auto& line : edges)
+						for (const point3* point : { &line.startPoint, &line.endPoint })
+						{
+							low.x = std::min(low.x, point->x);
+							low.y = std::min(low.y, point->y);
+							high.x = std::max(high.x, point->x);
+							high.y = std::max(high.y, point->y);
+						}
+					fitQuantization(low, high, lsystemScale, lsystemOffset);
+					QVertex* out = static_cast<QVertex*>(mapped);
+					vertexCount = buildStrips(edges, indices, [&](const point3& point) { *out++ = quantize(point, lsystemScale, lsystemOffset); });
+					printf("L-system quantized : %zu bytes of vertices instead of %zu, steps of %g x %g\n",
+						sizeof(QVertex) * vertexCount, sizeof(LVertex) * vertexCount, lsystemScale.x / 32767.0f, lsystemScale.y / 32767.0f);
+				}
+				else
+				{
+					LVertex* out = static_cast<LVertex*>(mapped);
+					vertexCount = buildStrips(edges, indices, [&](const point3& point) { *out++ = LVertex{ point, color }; });
+				}
+				glUnmapBuffer(GL_ARRAY_BUFFER);
+			}
+			printf("L-system line strips : %zu vertices and %zu indices instead of %zu vertices\n",
+				vertexCount, indices.size(), 2 * edges.size());
+			if (quantized)
+			{
+				// 4 bytes instead of 24 per vertex, the color is the constant value of vColor
+				if (lsystem.vPosition >= 0)
+				{
+					glVertexAttribPointer(lsystem.vPosition, 2, GL_SHORT, GL_TRUE, sizeof(QVertex), BUFFER_OFFSET(0));
+					glEnableVertexAttribArray(lsystem.vPosition);
+				}
+				if (lsystem.vColor >= 0)
+					glDisableVertexAttribArray(lsystem.vColor);
+			}
+			else
+			{
+				if (lsystem.vPosition >= 0)
+				{
+					glVertexAttribPointer(lsystem.vPosition, 3, GL_FLOAT, GL_FALSE, sizeof(LVertex), BUFFER_OFFSET(offsetof(LVertex, position)));
+					glEnableVertexAttribArray(lsystem.vPosition);
+				}
+				if (lsystem.vColor >= 0)
+				{
+					glVertexAttribPointer(lsystem.vColor, 3, GL_FLOAT, GL_FALSE, sizeof(LVertex), BUFFER_OFFSET(offsetof(LVertex, color)));
+					glEnableVertexAttribArray(lsystem.vColor);
+				}
+			}
+			glGenBuffers(1, &lsystemEBO);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lsystemEBO);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.data(), GL_STATIC_DRAW);
+			lsystemIndexCount = (GLsizei)indices.size();
+			if (!levelsOfDetail)
+			{
+				lsystemIndices.swap(indices);
+				lsystemBVH.build(edges, lsystemIndices);
+			}
+		}
+		// Step 5: One instance per tree, advancing once per tree instead of once per vertex
+		glGenBuffers(1, &forestVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, forestVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(TreeInstance) * forest.size(), forest.data(), GL_STATIC_DRAW);
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(offsetof(TreeInstance, offset)));
+		glEnableVertexAttribArray(2);
+		glVertexAttribDivisor(2, 1);
+		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(offsetof(TreeInstance, rotation)));
+		glEnableVertexAttribArray(3);
+		glVertexAttribDivisor(3, 1);
+		glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(offsetof(TreeInstance, tint)));
+		glEnableVertexAttribArray(5);
+		glVertexAttribDivisor(5, 1);
+		// (optional) Step 6: unbind VAO and VBO
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+	// leaf meshes and tree of moves of the hierarchical l-system
+	if (leafGenerations >= 0)
+	{
+		glGenVertexArrays(1, &hierarchyVAO);
+		glBindVertexArray(hierarchyVAO);
+		glGenBuffers(1, &hierarchyVBO);
+		glBindBuffer(GL_ARRAY_BUFFER, hierarchyVBO);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(LVertex) * hierarchy.vertices.size(), hierarchy.vertices.data(), GL_STATIC_DRAW);
+		if (hierarchyLocations.vPosition >= 0)
+		{
+			glVertexAttribPointer(hierarchyLocations.vPosition, 3, GL_FLOAT, GL_FALSE, sizeof(LVertex), BUFFER_OFFSET(offsetof(LVertex, position)));
+			glEnableVertexAttribArray(hierarchyLocations.vPosition);
+		}
+		if (hierarchyLocations.vColor >= 0)
+		{
+			glVertexAttribPointer(hierarchyLocations.vColor, 3, GL_FLOAT, GL_FALSE, sizeof(LVertex), BUFFER_OFFSET(offsetof(LVertex, color)));
+			glEnableVertexAttribArray(hierarchyLocations.vColor);
+		}
+		glGenBuffers(1, &hierarchyEBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, hierarchyEBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * hierarchy.indices.size(), hierarchy.indices.data(), GL_STATIC_DRAW);
+		glGenBuffers(1, &hierarchyTBO);
+		glBindBuffer(GL_TEXTURE_BUFFER, hierarchyTBO);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint) * hierarchy.texels.size(), hierarchy.texels.data(), GL_STATIC_DRAW);
+		glGenTextures(1, &hierarchyTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, hierarchyTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, hierarchyTBO);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		printf("L-system hierarchy : %zu bytes of moves and %zu bytes of leaves instead of %llu bytes of vertices\n",
+			sizeof(GLuint) * hierarchy.texels.size(),
+			sizeof(LVertex) * hierarchy.vertices.size() + sizeof(GLuint) * hierarchy.indices.size(),
+			lsystemSizes[generation].vertexBytes);
+		glUseProgram(hierarchyShader);
+		hierarchyShader.set(hierarchyLocations.hierarchy, 1);
+	}
+	// (optional) Step 6: unbind VAO and VBO
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	// both cubes are the same mesh with their own texture
+	std::vector<ResourceRegistry::Attribute> cubeAttributes{
+		{ cubeShader.attribute("aPos"), 3, 0 },
+		{ cubeShader.attribute("aTexCoords"), 2, 3 * sizeof(float) } };
+	cube1Mesh = resources.mesh(cubeVertices, sizeof(cubeVertices), 5 * sizeof(float), cubeAttributes);
+	cube2Mesh = resources.mesh(cubeVertices, sizeof(cubeVertices), 5 * sizeof(float), cubeAttributes);
+	std::vector<GLuint> cubeTextures = resources.textures({ "cube/Christmas.jpg", "cube/Christmas2.jpg" });
+	cube1Texture = cubeTextures[0];
+	cube2Texture = cubeTextures[1];
+	glUseProgram(cubeShader);
+	cubeShader.set(cubeShader.uniform("texture1"), 0);
+
+	// diffuse light, position and normal attributes
+	lightCubeMesh = resources.mesh(lightcubevertices, sizeof(lightcubevertices), 6 * sizeof(float), {
+		{ lightCubeShader.attribute("aPos"), 3, 0 },
+		{ lightCubeShader.attribute("aNormal"), 3, 3 * sizeof(float) } });
+	// second, configure the light's VAO (VBO stays the same; the vertices are the same for the light object which is also a 3D cube)
+	lightMesh = resources.mesh(lightcubevertices, sizeof(lightcubevertices), 6 * sizeof(float), {
+		{ lightShader.attribute("aPos"), 3, 0 } });
+
+	//  Generate and bind the VAO for the skybox
+	skyboxMesh = resources.mesh(skyboxVertices, sizeof(skyboxVertices), 3 * sizeof(float), {
+		{ skyboxShader.attribute("aPos"), 3, 0 } });
+	resources.report();
+
+	cubemapTexture = loadCubemap(faces);
+
+	glUseProgram(skyboxShader);
+	skyboxShader.set(skyboxShader.uniform("skybox"), 0);
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(restartIndex);
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+	glLineWidth(2.0);
+	glPointSize(3.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	// init() bound programs, arrays and textures on its own
+	glState.invalidate();
+}
+
+
+
+void display()
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	/*---  Set up and pass on Projection matrix to the shader ---*/
+	mat4 p = Perspective(fovy, aspect, zNear, zFar);
+	/*---  Set up and pass on Model-View matrix to the shader ---*/
+	vec4 at(0.0f, 0.0f, 0.0f, 1.0f);
+	vec4 up(0.0f, 1.0f, 0.0f, 0.0f);
+	vec4 eye(0.0, 0.0, 1.0f, 1.0); // negative Z (for skybox)
+
+	/*----- Write the camera and the model matrix of every object to the uniform blocks -----*/
+	FrameBlock frame{ LookAt(eye, at, up), p };
+	mat4 models[ObjectCount];
+	models[FloorObject] = Translate(X, 0.0f, 0.0f + Z) * Rotate(0.0f + A, 0.0f, 2.0f, 0.0f) * Scale(1.0f, 1.0f, 1.0f); // rotated and translated
+	models[TreesObject] = Translate(X, 0.0f, Z);
+	models[Cube1Object] = Translate(X + 1.5f, -0.45f, -1.0f + Z) * Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
+	models[Cube2Object] = Translate(X - 1.5f, -0.45f, -1.0f + Z) * Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
+	models[LightCubeObject] = Translate(0.0f, 0.0f, -2.0f) * Rotate(0.0f + AA, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
+	models[LightObject] = Translate(0.8f, 1.0f, -2.0f) * Rotate(0.0f, 0.0f, 2.0f, 0.0f) * Scale(0.3f, 0.3f, 0.3f);
+	models[SkyboxObject] = Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(1.0f, 1.0f, 1.0f); // the shader removes the translation
+	uploadUniformBlocks(frame, models);
+
+	// every object submits its draws, the queue orders them by state
+	auto distance = [&](ObjectSlot slot) { return -(frame.view * models[slot] * vec4(0.0f, 0.0f, 0.0f, 1.0f)).z; };
+	mat4 model_view = frame.view * models[TreesObject];
+	renderQueue.submit(OpaquePass, distance(FloorObject), meshPacket(lsystemShader, floorMesh, 0, 0, FloorObject, GL_LESS, []()
+		{
+			lsystemShader.set(lsystem.positionScale, vec3(1.0f, 1.0f, 1.0f));
+			lsystemShader.set(lsystem.positionOffset, vec3(0.0f, 0.0f, 0.0f));
+			lsystemShader.set(lsystem.treeRotation, 0.0f);
+			lsystemShader.set(lsystem.forestRotation, 0.0f);
+			// the floor is a single untransformed instance
+			glVertexAttrib3f(2, 0.0f, 0.0f, 0.0f);
+			glVertexAttrib2f(3, 0.0f, 1.0f);
+			glVertexAttrib4f(5, 1.0f, 1.0f, 1.0f, 1.0f);
+			glState.polygonMode(GL_FILL);
+		}));
+	renderQueue.submit(OpaquePass, distance(TreesObject), DrawPacket{ leafGenerations < 0 ? lsystemShader : hierarchyShader,
+		leafGenerations < 0 ? lsystemVAO : hierarchyVAO, 0, 0, TreesObject, GL_LESS, [model_view, p]() { drawTrees(model_view, p); } });
+	renderQueue.submit(OpaquePass, distance(Cube1Object), meshPacket(cubeShader, cube1Mesh, GL_TEXTURE_2D, cube1Texture, Cube1Object, GL_LESS));
+	renderQueue.submit(OpaquePass, distance(Cube2Object), meshPacket(cubeShader, cube2Mesh, GL_TEXTURE_2D, cube2Texture, Cube2Object, GL_LESS));
+	// cube for diffuse light
+	renderQueue.submit(OpaquePass, distance(LightCubeObject), meshPacket(lightCubeShader, lightCubeMesh, 0, 0, LightCubeObject, GL_LESS, []()
+		{
+			lightCubeShader.set(lightCube.objectColor, vec3(0.5f, 1.0f, 0.3f));
+			lightCubeShader.set(lightCube.lightColor, vec3(1.0f, 1.0f, 1.0f));
+			lightCubeShader.set(lightCube.lightPos, vec3(1.2f, 1.0f, 2.0f));
+		}));
+	// light 
+	renderQueue.submit(OpaquePass, distance(LightObject), meshPacket(lightShader, lightMesh, 0, 0, LightObject, GL_LESS));
+	// draw skybox as last, depth test passes when values are equal to depth buffer's content
+	renderQueue.submit(SkyboxPass, 0.0f, meshPacket(skyboxShader, skyboxMesh, GL_TEXTURE_CUBE_MAP, cubemapTexture, SkyboxObject, GL_LEQUAL));
+	renderQueue.execute();
+
+	glState.endFrame();
+	glutSwapBuffers();
+}
+
+void reshape(int w, int h)
+{
+	glViewport(0, 0, width, height);
+	aspect = (GLfloat)width / (GLfloat)height;
+	glutPostRedisplay();
+}
+
+void idle()
+{
+	AA += 0.03f;
+	glutPostRedisplay();
+}
+
+void keyboard(unsigned char key, int x, int y)
+{
+	switch (key)
+	{
+	case 'w':
+	case 'W':
+		Z += 0.1f;
+		break;
+
+	case 'a':
+	case 'A':
+		X += 0.1f;
+		break;
+
+	case 's':
+	case 'S':
+		Z -= 0.1f;
+		break;
+
+	case 'd':
+	case 'D':
+		X -= 0.1f;
+		break;
+
+	case ' ':
+		X = 0.0f;
+		Z = 0.0f;
+		break;
+
+	case 'i':
+	case 'I':
+		printf("GL state calls of the last frame : %zu issued, %zu skipped\n", glState.lastIssued, glState.lastSkipped);
+		break;
+
+	case 033: // Escape Key
+	case 'q':
+	case 'Q':
+		exit(EXIT_SUCCESS);
+
+
+	}
+	glutPostRedisplay();
+}
+
+void onMouseClick(int button, int state, int x, int y)
+{
+	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN && (glutGetModifiers() & GLUT_ACTIVE_SHIFT))
+	{
+		if (leafGenerations >= 0)
+			std::cout << "Branches can only be picked in the expanded l-system, not with -hierarchy" << std::endl;
+		else
+			pickBranch(x, y);
+	}
+	else if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+	{
+		//store the x,y value where the click happened
+		A += 11.0f;
+	}
+	if (button == GLUT_RIGHT_BUTTON && state == GLUT_DOWN)
+	{
+		//store the x,y value where the click happened
+		A -= 11.0f;
+	}
+	if (button == GLUT_MIDDLE_BUTTON && state == GLUT_DOWN)
+	{
+		//store the x,y value where the click happened
+		A = 0.0f;
+	}
+}
+
+
+/**
+ * @brief Run body(i) for every i in [0, count), spread over numThreads threads
+ */
+void parallelFor(size_t count, const std::function<void(size_t)>& body)
+{
+	size_t workers = std::min<size_t>(std::max(numThreads, 1u), count);
+	if (workers <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			body(i);
+		return;
+	}
+	std::vector<std::thread> threads;
+	threads.reserve(workers - 1);
+	// worker w takes every task in [w * count / workers, (w + 1) * count / workers)
+	for (size_t w = 1; w < workers; w++)
+	{
+		threads.emplace_back([&, w]()
+		{
+			for (size_t i = w * count / workers; i < (w + 1) * count / workers; i++)
+				body(i);
+		});
+	}
+	for (size_t i = 0; i < count / workers; i++)
+		body(i);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+
+/**
+ * @brief Initialize the axiom and rules for the L-System
+ */
+void LSystemRules()
+{
+	if (file.is_open())
+	{
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (line.length() == 1)
+			{
+				axiom = line;
+			}
+			else
+			{
+				char key = line[0];
+				std::string value = line.substr(2);
+				grammers.insert({ key, value });
+			}
+		}
+		tree = axiom;
+		file.close();
+	}
+	compileGrammar();
+	compileAlphabet();
+}
+
+
+/**
+ * @brief Add or multiply sizes, sticking at the largest value instead of wrapping
+ */
+unsigned long long saturatingAdd(unsigned long long a, unsigned long long b)
+{
+	return a > ULLONG_MAX - b ? ULLONG_MAX : a + b;
+}
+
+unsigned long long saturatingMultiply(unsigned long long a, unsigned long long b)
+{
+	return b != 0 && a > ULLONG_MAX / b ? ULLONG_MAX : a * b;
+}
+
+
+/**
+ * @brief Predict the size of generations 0..generations without expanding them.
+ * The symbol counts follow the growth matrix of the rules (row a holds how many
+ * of every symbol the production of a creates), and the bracket depth follows
+ * from the net and deepest nesting of every symbol's expansion one generation down.
+ */
+std::vector<LSystemSize> predictLSystem(int generations)
+{
+	// alphabet of the l-system, every symbol gets a row/column of the matrix
+	std::vector<unsigned char> alphabet;
+	int index[256];
+	std::fill(index, index + 256, -1);
+	auto addSymbol = [&](unsigned char symbol)
+	{
+		if (index[symbol] < 0)
+		{
+			index[symbol] = alphabet.size();
+			alphabet.push_back(symbol);
+		}
+	};
+	for (auto& symbol : axiom)
+		addSymbol(symbol);
+	for (auto& rule : grammers)
+	{
+		addSymbol(rule.first);
+		for (auto& symbol : rule.second)
+			addSymbol(symbol);
+	}
+
+	size_t n = alphabet.size();
+	std::vector<unsigned long long> growth(n * n, 0);
+	for (size_t a = 0; a < n; a++)
+	{
+		unsigned char symbol = alphabet[a];
+		const char* production = grammar.productions.data() + grammar.offset[symbol];
+		for (unsigned int i = 0; i < grammar.length[symbol]; i++)
+			growth[a * n + index[(unsigned char)production[i]]]++;
+	}
+
+	// symbol counts of the current generation, starting with the axiom
+	std::vector<unsigned long long> counts(n, 0), nextCounts(n);
+	for (auto& symbol : axiom)
+		counts[index[(unsigned char)symbol]]++;
+	// net and deepest nesting of every symbol expanded the current number of generations
+	std::vector<long long> net(n, 0), deepest(n, 0), nextNet(n), nextDeepest(n);
+	if (index['['] >= 0)
+		net[index['[']] = deepest[index['[']] = 1;
+	if (index[']'] >= 0)
+		net[index[']']] = -1;
+
+	auto walk = [&](const char* symbols, size_t length, long long& total, long long& maximum)
+	{
+		total = 0;
+		maximum = 0;
+		for (size_t i = 0; i < length; i++)
+		{
+			int a = index[(unsigned char)symbols[i]];
+			maximum = std::max(maximum, total + deepest[a]);
+			total += net[a];
+		}
+	};
+
+	std::vector<LSystemSize> sizes(generations + 1);
+	for (int g = 0; g <= generations; g++)
+	{
+		LSystemSize& size = sizes[g];
+		size.symbols = 0;
+		for (size_t a = 0; a < n; a++)
+			size.symbols = saturatingAdd(size.symbols, counts[a]);
+		size.edges = index['F'] >= 0 ? counts[index['F']] : 0;
+		long long total, maximum;
+		walk(axiom.data(), axiom.size(), total, maximum);
+		size.depth = maximum;
+		// every edge ends in a new vertex of the line strips, plus the start of the first one
+		size.vertexBytes = saturatingMultiply(size.edges + (size.edges > 0), quantized ? sizeof(QVertex) : sizeof(LVertex));
+
+		if (g == generations)
+			break;
+		// one more generation : counts times the growth matrix
+		std::fill(nextCounts.begin(), nextCounts.end(), 0);
+		for (size_t a = 0; a < n; a++)
+		{
+			if (counts[a] == 0)
+				continue;
+			for (size_t b = 0; b < n; b++)
+				nextCounts[b] = saturatingAdd(nextCounts[b], saturatingMultiply(counts[a], growth[a * n + b]));
+		}
+		counts.swap(nextCounts);
+		// one more generation of nesting : walk every production with the current values
+		for (size_t a = 0; a < n; a++)
+		{
+			unsigned char symbol = alphabet[a];
+			walk(grammar.productions.data() + grammar.offset[symbol], grammar.length[symbol], nextNet[a], nextDeepest[a]);
+		}
+		net.swap(nextNet);
+		deepest.swap(nextDeepest);
+	}
+	return sizes;
+}
+
+
+/**
+ * @brief Compare the predicted memory use of the l-system with memoryBudget.
+ * Switches to the streaming mode when only the string does not fit and stops
+ * the program when even the geometry does not fit. With -lod the strings and
+ * the coarser levels count as geometry, buildLevels() can not stream them.
+ */
+void checkMemoryBudget()
+{
+	const LSystemSize& size = lsystemSizes[generation];
+	// edges, the line strip vertices and indices (at most three per edge) built from them and the memories stack
+	unsigned long long geometry = saturatingAdd(
+		saturatingAdd(saturatingMultiply(size.edges, sizeof(Edge) + 3 * sizeof(GLuint)), size.vertexBytes),
+		saturatingMultiply(size.depth, sizeof(Memory)));
+	// tree and the buffer the last generation is rewritten from
+	unsigned long long strings = saturatingAdd(size.symbols, generation > 0 ? lsystemSizes[generation - 1].symbols : 0);
+	// LSystemString() falls back to the plain string when the alphabet is too big to pack
+	if (expansionMode == ExpansionMode::Packed && alphabet.bits != 0 && !levelsOfDetail)
+		strings = strings / (8 / alphabet.bits) + 16;
+	if (levelsOfDetail)
+	{
+		for (int g = 0; g < generation; g++)
+			geometry = saturatingAdd(geometry, saturatingAdd(lsystemSizes[g].vertexBytes,
+				saturatingMultiply(lsystemSizes[g].edges, 3 * sizeof(GLuint))));
+		geometry = saturatingAdd(geometry, strings);
+	}
+
+	printf("L-system generation %d : %llu symbols, %llu edges, depth %llu, %llu bytes of vertices\n",
+		generation, size.symbols, size.edges, size.depth, size.vertexBytes);
+	if (geometry > memoryBudget)
+	{
+		std::cerr << "The l-system needs " << (geometry >> 20) << " MB for its geometry, more than the budget of "
+			<< (memoryBudget >> 20) << " MB!" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (!levelsOfDetail && (expansionMode == ExpansionMode::String || expansionMode == ExpansionMode::Packed) &&
+		saturatingAdd(geometry, strings) > memoryBudget)
+	{
+		std::cout << "The l-system string does not fit in the budget of " << (memoryBudget >> 20)
+			<< " MB, switching to streaming" << std::endl;
+		expansionMode = ExpansionMode::Stream;
+	}
+}
+
+
+/**
+ * @brief Build the production tables of grammar from grammers
+ */
+void compileGrammar()
+{
+	grammar.productions.clear();
+	// every byte starts out as a production of length 1 that rewrites to itself
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		grammar.offset[symbol] = symbol;
+		grammar.length[symbol] = 1;
+		grammar.rewritten[symbol] = false;
+		grammar.productions += (char)symbol;
+	}
+	for (auto& rule : grammers)
+	{
+		unsigned char symbol = rule.first;
+		grammar.offset[symbol] = grammar.productions.size();
+		grammar.length[symbol] = rule.second.size();
+		grammar.rewritten[symbol] = true;
+		grammar.productions += rule.second;
+	}
+}
+
+
+LSystemStream::LSystemStream(const std::string& axiom, int generation)
+	: generation{ generation }
+{
+	stack.reserve(generation + 1);
+	stack.push_back({ axiom.data(), axiom.data() + axiom.size(), 0 });
+}
+
+/**
+ * @brief Get the next symbol of the final generation
+ * @param symbol receives the symbol
+ * @return false once the whole string has been produced
+ */
+bool LSystemStream::next(char& symbol)
+{
+	while (!stack.empty())
+	{
+		Frame& top = stack.back();
+		if (top.next == top.end)
+		{
+			stack.pop_back();
+			continue;
+		}
+		unsigned char current = *top.next++;
+		if (top.depth < generation && grammar.rewritten[current])
+		{
+			// descend into the rule instead of emitting the symbol
+			const char* production = grammar.productions.data() + grammar.offset[current];
+			stack.push_back({ production, production + grammar.length[current], top.depth + 1 });
+			continue;
+		}
+		symbol = current;
+		return true;
+	}
+	return false;
+}
+
+
+/**
+ * @brief Create L-system string
+ */
+void LSystemString()
+{
+	if (expansionMode == ExpansionMode::Packed && alphabet.bits == 0)
+	{
+		std::cout << "The l-system has too many symbols to pack, using the plain string" << std::endl;
+		expansionMode = ExpansionMode::String;
+	}
+	if (expansionMode == ExpansionMode::Packed)
+	{
+		PackedString newTree;
+		packedTree.reset(alphabet.bits, axiom.size());
+		for (size_t i = 0; i < axiom.size(); i++)
+			packedTree.set(i, alphabet.code[(unsigned char)axiom[i]]);
+		tree.clear();
+		for (int i = 0; i < generation; i++)
+		{
+			rewritePacked(packedTree, newTree);
+			std::swap(packedTree, newTree);
+		}
+		return;
+	}
+	// the other modes expand the symbols inside LSystem()
+	if (expansionMode != ExpansionMode::String)
+		return;
+	// tree ends up holding the even generations and newTree the odd ones
+	std::string newTree;
+	if (!lsystemSizes.empty() && generation > 0)
+	{
+		tree.reserve(lsystemSizes[generation - generation % 2].symbols);
+		newTree.reserve(lsystemSizes[generation - 1 + generation % 2].symbols);
+	}
+	for (int i = 0; i < generation; i++)
+	{
+		rewrite(tree, newTree);
+		tree.swap(newTree);
+	}
+}
+
+
+/**
+ * @brief symbols, the axiom unless given, rewritten generation times
+ */
+std::string expandTo(int generation, const std::string& symbols)
+{
+	std::string expanded = symbols, buffer;
+	for (int i = 0; i < generation; i++)
+	{
+		rewrite(expanded, buffer);
+		expanded.swap(buffer);
+	}
+	return expanded;
+}
+
+/**
+ * @brief Rewrite one generation in parallel. Every chunk of source first
+ * measures its expansion, a prefix sum of those lengths gives each chunk its
+ * offset, and then the chunks are expanded straight into the sized target.
+ */
+void rewrite(const std::string& source, std::string& target)
+{
+	const size_t minChunk = 1 << 16; // below this a thread costs more than it saves
+	size_t chunks = std::max<size_t>(1, std::min<size_t>(4 * std::max(numThreads, 1u), source.size() / minChunk));
+	std::vector<size_t> offsets(chunks + 1, 0);
+
+	// pass 1 : output length of every chunk
+	parallelFor(chunks, [&](size_t c)
+	{
+		size_t length = 0;
+		for (size_t i = c * source.size() / chunks; i < (c + 1) * source.size() / chunks; i++)
+			length += grammar.length[(unsigned char)source[i]];
+		offsets[c + 1] = length;
+	});
+	// exclusive prefix sum turns the lengths into output offsets
+	for (size_t c = 0; c < chunks; c++)
+		offsets[c + 1] += offsets[c];
+	target.resize(offsets[chunks]);
+
+	// pass 2 : every chunk writes its expansion into its own slice
+	parallelFor(chunks, [&](size_t c)
+	{
+		char* out = &target[0] + offsets[c];
+		const char* productions = grammar.productions.data();
+		for (size_t i = c * source.size() / chunks; i < (c + 1) * source.size() / chunks; i++)
+		{
+			unsigned char symbol = source[i];
+			std::memcpy(out, productions + grammar.offset[symbol], grammar.length[symbol]);
+			out += grammar.length[symbol];
+		}
+	});
+}
+
+
+/**
+ * @brief Give every symbol of the l-system a code and compile the productions
+ * to codes. Up to 4 symbols take 2 bits, up to 16 take 4 bits, more cannot be packed.
+ */
+void compileAlphabet()
+{
+	alphabet.size = 0;
+	std::fill(alphabet.code, alphabet.code + 256, 0);
+	bool used[256] = {};
+	auto addSymbol = [&](unsigned char symbol)
+	{
+		if (used[symbol])
+			return;
+		used[symbol] = true;
+		if (alphabet.size < 16)
+			alphabet.symbol[alphabet.size] = symbol;
+		alphabet.code[symbol] = alphabet.size++;
+	};
+	for (auto& symbol : axiom)
+		addSymbol(symbol);
+	for (auto& rule : grammers)
+	{
+		addSymbol(rule.first);
+		for (auto& symbol : rule.second)
+			addSymbol(symbol);
+	}
+	alphabet.bits = alphabet.size <= 4 ? 2 : alphabet.size <= 16 ? 4 : 0;
+	if (alphabet.bits == 0)
+		return;
+
+	alphabet.productions.clear();
+	for (int code = 0; code < 16; code++)
+	{
+		alphabet.productionOffset[code] = alphabet.productions.size();
+		alphabet.productionLength[code] = 0;
+		if (code >= alphabet.size)
+			continue;
+		unsigned char symbol = alphabet.symbol[code];
+		const char* production = grammar.productions.data() + grammar.offset[symbol];
+		for (unsigned int i = 0; i < grammar.length[symbol]; i++)
+			alphabet.productions.push_back(alphabet.code[(unsigned char)production[i]]);
+		alphabet.productionLength[code] = grammar.length[symbol];
+	}
+	int perByte = 8 / alphabet.bits;
+	unsigned int mask = (1u << alphabet.bits) - 1;
+	for (int byte = 0; byte < 256; byte++)
+	{
+		alphabet.byteLength[byte] = 0;
+		for (int j = 0; j < 4; j++)
+			alphabet.decode[byte][j] = 0;
+		for (int j = 0; j < perByte; j++)
+		{
+			unsigned int code = (byte >> (j * alphabet.bits)) & mask;
+			alphabet.decode[byte][j] = alphabet.symbol[code % alphabet.size];
+			alphabet.byteLength[byte] += alphabet.productionLength[code];
+		}
+	}
+}
+
+/**
+ * @brief Make room for length codes, all zero
+ */
+void PackedString::reset(int bits, size_t length)
+{
+	this->bits = bits;
+	this->length = length;
+	words.assign((length * bits + 63) / 64, 0);
+}
+
+size_t PackedString::size() const
+{
+	return length;
+}
+
+size_t PackedString::bytes() const
+{
+	return words.size() * sizeof(unsigned long long);
+}
+
+unsigned int PackedString::code(size_t i) const
+{
+	size_t bit = i * bits;
+	return (words[bit / 64] >> (bit % 64)) & ((1u << bits) - 1);
+}
+
+void PackedString::set(size_t i, unsigned int code)
+{
+	size_t bit = i * bits;
+	unsigned long long mask = (1ull << bits) - 1;
+	words[bit / 64] = (words[bit / 64] & ~(mask << (bit % 64))) | ((unsigned long long)code << (bit % 64));
+}
+
+/**
+ * @brief Decode up to count symbols starting at begin into out
+ * @return the number of symbols written
+ */
+size_t PackedString::unpack(const PackedAlphabet& alphabet, size_t begin, size_t count, char* out) const
+{
+	size_t end = std::min(length, begin + count);
+	int perByte = 8 / bits;
+	size_t i = begin;
+	// single codes up to a byte boundary
+	for (; i < end && i % perByte != 0; i++)
+		*out++ = alphabet.symbol[code(i)];
+	// whole bytes through the decode table
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(words.data());
+	for (; i + perByte <= end; i += perByte)
+	{
+		std::memcpy(out, alphabet.decode[bytes[i / perByte]], perByte);
+		out += perByte;
+	}
+	for (; i < end; i++)
+		*out++ = alphabet.symbol[code(i)];
+	return end > begin ? end - begin : 0;
+}
+
+/**
+ * @brief Count the occurrences of a code a word at a time
+ */
+size_t PackedString::count(unsigned int code) const
+{
+	// every field of pattern holds code, high has the top bit of every field set
+	unsigned long long pattern = 0, high = 0;
+	for (int bit = 0; bit < 64; bit += bits)
+	{
+		pattern |= (unsigned long long)code << bit;
+		high |= 1ull << (bit + bits - 1);
+	}
+	size_t total = 0;
+	size_t fullWords = length * bits / 64;
+	for (size_t w = 0; w < fullWords; w++)
+	{
+		// fields equal to code become zero; adding the low bits carries into
+		// the top bit of every field that is not zero
+		unsigned long long x = words[w] ^ pattern;
+		unsigned long long nonzero = (((x & ~high) + ~high) | x) & high;
+		// count the top bits that are set
+		nonzero = nonzero - ((nonzero >> 1) & 0x5555555555555555ull);
+		nonzero = (nonzero & 0x3333333333333333ull) + ((nonzero >> 2) & 0x3333333333333333ull);
+		nonzero = (((nonzero + (nonzero >> 4)) & 0x0F0F0F0F0F0F0F0Full) * 0x0101010101010101ull) >> 56;
+		total += 64 / bits - nonzero;
+	}
+	for (size_t i = fullWords * 64 / bits; i < length; i++)
+		total += this->code(i) == code;
+	return total;
+}
+
+/**
+ * @brief Rewrite one packed generation without unpacking it. Works like
+ * rewrite() : the chunks are measured a byte at a time, placed with a prefix
+ * sum and expanded in parallel. The words on the border of two chunks are
+ * shared, so those are merged after the threads are done.
+ */
+void rewritePacked(const PackedString& source, PackedString& target)
+{
+	const size_t minChunk = 1 << 16;
+	int bits = source.bits;
+	int perByte = 8 / bits;
+	int perWord = 64 / bits;
+	// chunks start on word boundaries of the source
+	size_t sourceWords = (source.size() + perWord - 1) / perWord;
+	size_t chunks = std::max<size_t>(1, std::min<size_t>(4 * std::max(numThreads, 1u), source.size() / minChunk));
+	auto chunkBegin = [&](size_t c) { return std::min(source.size(), c * sourceWords / chunks * perWord); };
+	std::vector<size_t> offsets(chunks + 1, 0);
+
+	// pass 1 : output length of every chunk
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(source.words.data());
+	parallelFor(chunks, [&](size_t c)
+	{
+		size_t begin = chunkBegin(c), end = chunkBegin(c + 1), length = 0, i = begin;
+		for (; i + perByte <= end; i += perByte)
+			length += alphabet.byteLength[bytes[i / perByte]];
+		for (; i < end; i++)
+			length += alphabet.productionLength[source.code(i)];
+		offsets[c + 1] = length;
+	});
+	for (size_t c = 0; c < chunks; c++)
+		offsets[c + 1] += offsets[c];
+	target.reset(bits, offsets[chunks]);
+
+	// pass 2 : every chunk writes whole words itself and leaves its border words
+	struct Border
+	{
+		size_t word;
+		unsigned long long bits;
+	};
+	std::vector<Border> borders(2 * chunks, { 0, 0 });
+	parallelFor(chunks, [&](size_t c)
+	{
+		size_t bit = offsets[c] * bits;
+		size_t word = bit / 64, shift = bit % 64;
+		bool first = shift != 0; // the first word is shared with the previous chunk
+		unsigned long long accumulator = 0;
+		for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); i++)
+		{
+			unsigned int code = source.code(i);
+			const unsigned char* production = alphabet.productions.data() + alphabet.productionOffset[code];
+			for (unsigned int j = 0; j < alphabet.productionLength[code]; j++)
+			{
+				accumulator |= (unsigned long long)production[j] << shift;
+				shift += bits;
+				if (shift == 64)
+				{
+					if (first)
+						borders[2 * c] = { word, accumulator };
+					else
+						target.words[word] = accumulator;
+					first = false;
+					word++;
+					shift = 0;
+					accumulator = 0;
+				}
+			}
+		}
+		// a partly filled last word is shared with the next chunk
+		if (shift != 0)
+			borders[2 * c + 1] = { word, accumulator };
+	});
+	for (auto& border : borders)
+	{
+		if (border.bits)
+			target.words[border.word] |= border.bits;
+	}
+}
+
+
+/**
+ * @brief Build the DAG of the axiom expanded generation times
+ */
+LSystemDAG::LSystemDAG(int generation)
+{
+	Node top{};
+	for (auto& symbol : axiom)
+		top.children.push_back(node(symbol, generation));
+	root = intern(std::move(top));
+}
+
+size_t LSystemDAG::ChildrenHash::operator()(const std::vector<int>& children) const
+{
+	// FNV-1a over the child ids
+	size_t hash = 2166136261u;
+	for (int child : children)
+		hash = (hash ^ (size_t)child) * 16777619u;
+	return hash;
+}
+
+/**
+ * @brief Get the node of symbol expanded the given number of generations,
+ * building it (and the nodes below it) on first use
+ */
+int LSystemDAG::node(unsigned char symbol, int generations)
+{
+	// a symbol without a rule is the same leaf at every depth
+	if (!grammar.rewritten[symbol])
+		generations = 0;
+	auto found = bySymbol.find(generations * 256 + symbol);
+	if (found != bySymbol.end())
+		return found->second;
+
+	Node n{};
+	if (generations == 0)
+	{
+		n.length = 1;
+		n.text = std::string(1, (char)symbol);
+		int id = nodes.size();
+		nodes.push_back(std::move(n));
+		bySymbol[symbol] = id;
+		return id;
+	}
+	const char* production = grammar.productions.data() + grammar.offset[symbol];
+	for (unsigned int i = 0; i < grammar.length[symbol]; i++)
+		n.children.push_back(node(production[i], generations - 1));
+	int id = intern(std::move(n));
+	bySymbol[generations * 256 + symbol] = id;
+	return id;
+}
+
+/**
+ * @brief Add an inner node unless a node with the same children already exists
+ */
+int LSystemDAG::intern(Node&& n)
+{
+	auto found = byChildren.find(n.children);
+	if (found != byChildren.end())
+		return found->second;
+
+	const size_t shortText = 64; // expansions up to this length are also kept as text
+	n.length = 0;
+	for (int child : n.children)
+		n.length = saturatingAdd(n.length, nodes[child].length);
+	if (n.length <= shortText)
+	{
+		for (int child : n.children)
+			n.text += nodes[child].text;
+	}
+	int id = nodes.size();
+	byChildren.emplace(n.children, id);
+	nodes.push_back(std::move(n));
+	return id;
+}
+
+size_t LSystemDAG::nodeCount() const
+{
+	return nodes.size();
+}
+
+unsigned long long LSystemDAG::size() const
+{
+	return nodes[root].length;
+}
+
+/**
+ * @brief Call visit(symbol) for every symbol of generation N in order, reading
+ * the shared nodes again wherever they occur instead of storing the string
+ */
+template <typename Visit>
+void LSystemDAG::walk(Visit visit) const
+{
+	struct Frame
+	{
+		int node;
+		size_t child;
+	};
+	std::vector<Frame> stack{ { root, 0 } };
+	while (!stack.empty())
+	{
+		Frame& top = stack.back();
+		const Node& n = nodes[top.node];
+		if (!n.text.empty())
+		{
+			for (auto& symbol : n.text)
+				visit(symbol);
+			stack.pop_back();
+		}
+		else if (top.child == n.children.size())
+		{
+			stack.pop_back();
+		}
+		else
+		{
+			stack.push_back({ n.children[top.child++], 0 });
+		}
+	}
+}
+
+
+/**
+ * @brief Build the expansion table of every symbol for 0..generation generations
+ */
+LSystemView::LSystemView(int generation)
+	: generation{ generation }, expansions((generation + 1) * 256)
+{
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		Expansion& e = expansions[symbol];
+		e = { 1, 0, 0.0, 0.0, symbol != '[' && symbol != ']' };
+		if (symbol == '+')
+			e.turns = 1;
+		else if (symbol == '-')
+			e.turns = -1;
+		else if (symbol == 'F')
+			e.dy = gl_len;
+	}
+	for (int g = 1; g <= generation; g++)
+	{
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			Expansion& e = expansions[g * 256 + symbol];
+			if (!grammar.rewritten[symbol])
+			{
+				e = expansions[symbol];
+				continue;
+			}
+			// run the production one generation down on a turtle that starts heading up
+			TurtleContext context;
+			const char* production = grammar.productions.data() + grammar.offset[symbol];
+			e.length = 0;
+			for (unsigned int i = 0; i < grammar.length[symbol]; i++)
+			{
+				unsigned char child = production[i];
+				e.length = saturatingAdd(e.length, expansion(g - 1, child).length);
+				apply(g - 1, child, context);
+			}
+			e.turns = context.state.turns;
+			e.dx = context.state.x;
+			e.dy = context.state.y;
+			e.balanced = context.valid && context.stack.empty();
+		}
+	}
+}
+
+const LSystemView::Expansion& LSystemView::expansion(int generations, unsigned char symbol) const
+{
+	return expansions[generations * 256 + symbol];
+}
+
+/**
+ * @brief Move the turtle of context over symbol expanded the given number of generations
+ */
+void LSystemView::apply(int generations, unsigned char symbol, TurtleContext& context) const
+{
+	const Expansion& e = expansion(generations, symbol);
+	if (e.length == 1 && symbol == '[')
+	{
+		context.stack.push_back(context.state);
+	}
+	else if (e.length == 1 && symbol == ']')
+	{
+		if (context.stack.empty())
+		{
+			context.valid = false;
+			return;
+		}
+		context.state = context.stack.back();
+		context.stack.pop_back();
+	}
+	else
+	{
+		// rotate the displacement into the current heading
+		double rads = context.state.turns * angle * DegreesToRadians;
+		double c = cos(rads), s = sin(rads);
+		context.state.x += c * e.dx - s * e.dy;
+		context.state.y += s * e.dx + c * e.dy;
+		context.state.turns += e.turns;
+		context.valid = context.valid && e.balanced;
+	}
+}
+
+unsigned long long LSystemView::size() const
+{
+	unsigned long long length = 0;
+	for (auto& symbol : axiom)
+		length = saturatingAdd(length, expansion(generation, symbol).length);
+	return length;
+}
+
+/**
+ * @brief Walk from the axiom down to symbol k, one production per generation.
+ * visit(symbols, index, end, generations) is called on every level passed
+ * through, with index pointing at the symbol that contains k.
+ * @return the symbol at k, or 0 if k is past the end
+ */
+template <typename Visit>
+char LSystemView::descend(unsigned long long k, Visit visit) const
+{
+	const char* symbols = axiom.data();
+	const char* end = symbols + axiom.size();
+	for (int g = generation; ; g--)
+	{
+		const char* index = symbols;
+		while (index != end && k >= expansion(g, *index).length)
+		{
+			k -= expansion(g, *index).length;
+			index++;
+		}
+		if (index == end)
+			return 0;
+		visit(symbols, index, end, g);
+		unsigned char symbol = *index;
+		if (g == 0 || !grammar.rewritten[symbol])
+			return symbol;
+		symbols = grammar.productions.data() + grammar.offset[symbol];
+		end = symbols + grammar.length[symbol];
+	}
+}
+
+/**
+ * @brief Find symbol k of generation N in O(generation) steps
+ * @param context if given, receives the turtle state right before symbol k
+ * @return the symbol, or 0 if k is past the end of the string
+ */
+char LSystemView::seek(unsigned long long k, TurtleContext* context) const
+{
+	if (context)
+	{
+		*context = TurtleContext{};
+		context->state.y = -0.5;
+	}
+	return descend(k, [&](const char* symbols, const char* index, const char*, int g)
+	{
+		if (context)
+		{
+			// the symbols before index on this level are all behind k
+			for (const char* symbol = symbols; symbol != index; symbol++)
+				apply(g, *symbol, *context);
+		}
+	});
+}
+
+/**
+ * @brief Get a stream that yields generation N from symbol k on, which lets
+ * separate threads or passes work on separate chunks of the string
+ */
+LSystemStream LSystemView::streamFrom(unsigned long long k) const
+{
+	LSystemStream stream;
+	stream.generation = generation;
+	stream.stack.reserve(generation + 1);
+	descend(k, [&](const char*, const char* index, const char* end, int g)
+	{
+		// the symbol at index is read again by the stream once it is on top
+		if (!stream.stack.empty())
+			stream.stack.back().next++;
+		stream.stack.push_back({ index, end, generation - g });
+	});
+	return stream;
+}
+
+
+/**
+ * @brief Build the leaf meshes and the tree of moves of generation.
+ * texels holds one header (first texel of the children, number of children)
+ * per node, node (symbol, k) at (k - 1) * symbols + index of symbol and the
+ * root after them. Every child takes two texels : the turtle state it starts
+ * from (x and y as float bits, turns, its node) and for every leaf mesh the
+ * number of its copies in the children before it.
+ */
+LSystemHierarchy::LSystemHierarchy(int generation, int leafGenerations)
+{
+	leafGenerations = std::min(leafGenerations, generation);
+	int levels = generation - leafGenerations;
+	steps = levels + 1;
+
+	// symbols of the rules
+	std::string symbols;
+	int index[256];
+	std::fill(index, index + 256, -1);
+	auto addSymbols = [&](const char* text, size_t length)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			unsigned char symbol = text[i];
+			if (index[symbol] < 0)
+			{
+				index[symbol] = (int)symbols.size();
+				symbols.push_back(symbol);
+			}
+		}
+	};
+	addSymbols(axiom.data(), axiom.size());
+	for (size_t i = 0; i < symbols.size(); i++)
+	{
+		unsigned char symbol = symbols[i];
+		if (grammar.rewritten[symbol])
+			addSymbols(grammar.productions.data() + grammar.offset[symbol], grammar.length[symbol]);
+	}
+	auto production = [&](unsigned char symbol, const char*& text, size_t& length)
+	{
+		// a symbol without a rule stays itself
+		text = grammar.rewritten[symbol] ? grammar.productions.data() + grammar.offset[symbol] : (const char*)&symbols[index[symbol]];
+		length = grammar.rewritten[symbol] ? grammar.length[symbol] : 1;
+	};
+
+	// leaf meshes, drawn by the same turtle from the origin heading up
+	int leafOf[256];
+	std::fill(leafOf, leafOf + 256, -1);
+	std::vector<Edge> savedEdges;
+	std::vector<Memory> savedMemories;
+	savedEdges.swap(edges);
+	savedMemories.swap(memories);
+	Memory savedTurtle = turtle;
+	for (auto& symbol : symbols)
+	{
+		std::string expanded = expandTo(leafGenerations, std::string(1, symbol));
+		edges.clear();
+		memories.clear();
+		turtle = Memory{ point3{ 0.0, 0.0, 0.0 }, 0 };
+		for (auto& s : expanded)
+			interpret(s);
+		if (edges.empty())
+			continue;
+		if (leaves.size() == maxLeaves)
+		{
+			std::cout << "The l-system has more than " << maxLeaves << " symbols that draw" << std::endl;
+			leaves.clear();
+			break;
+		}
+		std::vector<LVertex> leafVertices;
+		std::vector<GLuint> leafIndices;
+		buildStrips(edges, color, leafVertices, leafIndices);
+		leafOf[(unsigned char)symbol] = (int)leaves.size();
+		leaves.push_back({ (unsigned char)symbol, (GLuint)indices.size(), (GLsizei)leafIndices.size(), 0 });
+		GLuint base = (GLuint)vertices.size();
+		for (auto& i : leafIndices)
+			indices.push_back(i == restartIndex ? i : base + i);
+		vertices.insert(vertices.end(), leafVertices.begin(), leafVertices.end());
+	}
+	edges.swap(savedEdges);
+	memories.swap(savedMemories);
+	turtle = savedTurtle;
+	if (leaves.empty())
+		return;
+
+	// copies of every leaf in node (symbol, k), k = 0 being the leaf itself
+	size_t n = symbols.size();
+	std::vector<unsigned long long> copies((levels + 1) * n * maxLeaves, 0);
+	auto copiesOf = [&](int k, unsigned char symbol) { return &copies[(k * n + index[symbol]) * maxLeaves]; };
+	for (auto& symbol : symbols)
+		if (leafOf[(unsigned char)symbol] >= 0)
+			copiesOf(0, symbol)[leafOf[(unsigned char)symbol]] = 1;
+	for (int k = 1; k <= levels; k++)
+	{
+		for (auto& symbol : symbols)
+		{
+			const char* text;
+			size_t length;
+			production(symbol, text, length);
+			unsigned long long* sum = copiesOf(k, symbol);
+			for (size_t i = 0; i < length; i++)
+				for (int l = 0; l < maxLeaves; l++)
+					sum[l] = saturatingAdd(sum[l], copiesOf(k - 1, text[i])[l]);
+		}
+	}
+
+	// the tree of moves, the children of a node expand leafGenerations + k - 1 generations
+	LSystemView view{ generation };
+	root = (GLuint)(levels * n);
+	texels.assign(4 * (root + 1), 0);
+	auto addNode = [&](GLuint node, const char* text, size_t length, int k, TurtleContext context)
+	{
+		GLuint first = (GLuint)texels.size() / 4;
+		texels[4 * node] = first;
+		texels[4 * node + 1] = (GLuint)length;
+		unsigned long long before[maxLeaves] = {};
+		for (size_t i = 0; i < length; i++)
+		{
+			unsigned char child = text[i];
+			GLfloat x = (GLfloat)context.state.x, y = (GLfloat)context.state.y;
+			GLuint bits[2];
+			std::memcpy(bits, &x, sizeof(GLfloat));
+			std::memcpy(bits + 1, &y, sizeof(GLfloat));
+			texels.insert(texels.end(), { bits[0], bits[1], (GLuint)(int)context.state.turns,
+				k > 1 ? (GLuint)((k - 2) * n + index[child]) : 0u });
+			for (int l = 0; l < maxLeaves; l++)
+			{
+				if (before[l] > INT_MAX)
+					valid = false;
+				texels.push_back((GLuint)before[l]);
+				before[l] = saturatingAdd(before[l], copiesOf(k - 1, child)[l]);
+			}
+			view.apply(leafGenerations + k - 1, child, context);
+		}
+		// the copies have to be counted by a GLsizei and the moves only compose with balanced brackets
+		valid = valid && context.valid && (node == root || context.stack.empty());
+	};
+	valid = true;
+	for (int k = 1; k <= levels; k++)
+	{
+		for (auto& symbol : symbols)
+		{
+			// the brackets hold no copies, so nothing walks into them
+			if (symbol == '[' || symbol == ']')
+				continue;
+			const char* text;
+			size_t length;
+			production(symbol, text, length);
+			addNode((GLuint)((k - 1) * n + index[(unsigned char)symbol]), text, length, k, TurtleContext{});
+		}
+	}
+	TurtleContext start;
+	start.state.y = -0.5;
+	addNode(root, axiom.data(), axiom.size(), levels + 1, start);
+	for (auto& leaf : leaves)
+	{
+		unsigned long long total = 0;
+		for (auto& symbol : axiom)
+			total = saturatingAdd(total, copiesOf(levels, symbol)[leafOf[leaf.symbol]]);
+		if (total > INT_MAX)
+			valid = false;
+		leaf.instances = (GLsizei)std::min<unsigned long long>(total, INT_MAX);
+	}
+}
+
+
+/**
+ * @brief Apply one symbol of the L-system string to the turtle
+ */
+void interpret(char symbol)
+{
+	if (symbol == 'F')
+	{
+		createEdge();
+	}
+	else if (symbol == '+')
+	{
+		rotateLeft();
+	}
+	else if (symbol == '-')
+	{
+		rotateRight();
+	}
+	else if (symbol == '[')
+	{
+		push();
+	}
+	else if (symbol == ']')
+	{
+		pop();
+	}
+}
+
+
+/**
+ * @brief Create L-system
+ */
+void LSystem()
+{
+	if (!lsystemSizes.empty())
+	{
+		edges.reserve(lsystemSizes[generation].edges);
+		memories.reserve(lsystemSizes[generation].depth);
+	}
+	headings.reset(angle, gl_len);
+	if (expansionMode == ExpansionMode::Stream)
+	{
+		LSystemStream stream{ axiom, generation };
+		char symbol;
+		while (stream.next(symbol))
+			interpret(symbol);
+	}
+	else if (expansionMode == ExpansionMode::Packed)
+	{
+		interpretParallel(packedTree.size(), PackedReader{});
+	}
+	else if (expansionMode == ExpansionMode::DAG)
+	{
+		LSystemDAG dag{ generation };
+		printf("L-system DAG : %zu nodes for %llu symbols\n", dag.nodeCount(), dag.size());
+		dag.walk(interpret);
+	}
+	else
+	{
+		interpretParallel(tree.size(), StringReader{});
+	}
+}
+
+
+/**
+ * @brief Turtle move relative to the state it starts from
+ */
+struct TurtleMove
+{
+	double x, y; // displacement in the frame of the start state
+	int turns; // change of heading
+};
+
+/**
+ * @brief Apply a relative move to an absolute turtle state
+ */
+Memory applyMove(const Memory& from, const TurtleMove& move)
+{
+	double rads = std::fmod((double)from.turns * angle, 360.0) * M_PI / 180.0;
+	double c = cos(rads), s = sin(rads);
+	Memory to;
+	to.position = point3{ (GLfloat)(from.position.x + c * move.x - s * move.y),
+		(GLfloat)(from.position.y + s * move.x + c * move.y), 0.0 };
+	to.turns = from.turns + move.turns;
+	if (headings.period() != 0)
+		to.turns = ((to.turns % headings.period()) + headings.period()) % headings.period();
+	return to;
+}
+
+/**
+ * @brief Interpret the l-system string on all threads.
+ * 1. Every chunk runs a turtle relative to its unknown start state. Brackets
+ *    matched inside the chunk cancel out, so what is left is the number of ']'
+ *    closing brackets of earlier chunks, the move after the last of those and
+ *    the moves of the '[' still open at the end, plus its number of edges.
+ * 2. A scan over the chunks composes those moves into the absolute start state
+ *    and bracket stack of every chunk, and a prefix sum of the edge counts
+ *    gives every chunk its slot in edges.
+ * 3. Every chunk runs the real turtle from its start state into its slot.
+ * @param read read(begin, end, visit) calls visit on the symbols [begin, end),
+ * a StringReader or PackedReader so the calls inline
+ */
+template <typename Read>
+void interpretParallel(size_t length, const Read& read)
+{
+	const size_t minChunk = 1 << 16; // below this a thread costs more than it saves
+	size_t chunks = numThreads > 1 ? std::min<size_t>(4 * numThreads, length / minChunk) : 1;
+	if (chunks <= 1)
+	{
+		read(0, length, [](char symbol) { interpret(symbol); });
+		return;
+	}
+	auto chunkBegin = [&](size_t c) { return c * length / chunks; };
+
+	// pass 1 : relative turtle of every chunk
+	struct Summary
+	{
+		size_t pops; // ']' matching a '[' of an earlier chunk
+		TurtleMove end; // move from the state restored by the last of those (or the start)
+		std::vector<TurtleMove> pushes; // states of the '[' left open, relative to the same state
+		size_t edges;
+	};
+	std::vector<Summary> summaries(chunks);
+	parallelFor(chunks, [&](size_t c)
+	{
+		HeadingTable table = headings; // grows on its own when angle does not divide 360
+		Summary& summary = summaries[c];
+		summary = Summary{ 0, TurtleMove{ 0.0, 0.0, 0 }, {}, 0 };
+		TurtleMove& move = summary.end;
+		std::vector<TurtleMove>& stack = summary.pushes;
+		read(chunkBegin(c), chunkBegin(c + 1), [&](char symbol)
+		{
+			if (symbol == 'F')
+			{
+				const vec2& step = table.step(move.turns);
+				move.x += step.x;
+				move.y += step.y;
+				summary.edges++;
+			}
+			else if (symbol == '+')
+				move.turns = table.turn(move.turns, 1);
+			else if (symbol == '-')
+				move.turns = table.turn(move.turns, -1);
+			else if (symbol == '[')
+				stack.push_back(move);
+			else if (symbol == ']')
+			{
+				if (!stack.empty())
+				{
+					move = stack.back();
+					stack.pop_back();
+				}
+				else
+				{
+					// closes a '[' of an earlier chunk, continue from the state it saved
+					summary.pops++;
+					move = TurtleMove{ 0.0, 0.0, 0 };
+				}
+			}
+		});
+	});
+
+	// scan : absolute start state, open brackets and edge offset of every chunk
+	std::vector<Memory> starts(chunks);
+	std::vector<std::vector<Memory>> startStacks(chunks);
+	std::vector<size_t> offsets(chunks + 1, 0);
+	Memory state = turtle;
+	std::vector<Memory> stack = memories;
+	for (size_t c = 0; c < chunks; c++)
+	{
+		const Summary& summary = summaries[c];
+		starts[c] = state;
+		// the chunk only ever sees the entries it pops
+		size_t seen = std::min(summary.pops, stack.size());
+		startStacks[c].assign(stack.end() - seen, stack.end());
+		Memory base = state;
+		for (size_t i = 0; i < seen; i++)
+		{
+			base = stack.back();
+			stack.pop_back();
+		}
+		state = applyMove(base, summary.end);
+		for (auto& push : summary.pushes)
+			stack.push_back(applyMove(base, push));
+		offsets[c + 1] = offsets[c] + summary.edges;
+	}
+
+	// pass 2 : every chunk draws its edges into its own slot
+	size_t first = edges.size();
+	edges.resize(first + offsets[chunks]);
+	parallelFor(chunks, [&](size_t c)
+	{
+		HeadingTable table = headings;
+		Memory current = starts[c];
+		std::vector<Memory>& saved = startStacks[c];
+		Edge* out = edges.data() + first + offsets[c];
+		read(chunkBegin(c), chunkBegin(c + 1), [&](char symbol)
+		{
+			if (symbol == 'F')
+			{
+				const vec2& step = table.step(current.turns);
+				point3 end{ current.position.x + step.x, current.position.y + step.y, 0.0 };
+				*out++ = Edge{ current.position, end };
+				current.position = end;
+			}
+			else if (symbol == '+')
+				current.turns = table.turn(current.turns, 1);
+			else if (symbol == '-')
+				current.turns = table.turn(current.turns, -1);
+			else if (symbol == '[')
+				saved.push_back(current);
+			else if (symbol == ']' && !saved.empty())
+			{
+				current = saved.back();
+				saved.pop_back();
+			}
+		});
+	});
+	turtle = state;
+	memories = stack;
+}
+
+/**
+ * @brief Set up the table for turns of angle degrees and edges of the given length
+ */
+void HeadingTable::reset(GLfloat angle, GLfloat length)
+{
+	this->angle = angle;
+	this->length = length;
+	// angle divides 360 when some whole number of turns makes a full circle
+	double turnsPerCircle = 360.0 / angle;
+	periodTurns = 0;
+	if (std::fabs(angle) > 1e-3 && std::fabs(turnsPerCircle - std::round(turnsPerCircle)) < 1e-4)
+		periodTurns = (int)std::fabs(std::round(turnsPerCircle));
+	lowest = 0;
+	steps.clear();
+	for (int turns = 0; turns < std::max(periodTurns, 1); turns++)
+		steps.push_back(direction(turns));
+}
+
+int HeadingTable::period() const
+{
+	return periodTurns;
+}
+
+/**
+ * @brief Turn a heading by the given number of turns, wrapping around when the table has a period
+ */
+int HeadingTable::turn(int turns, int by) const
+{
+	turns += by;
+	if (periodTurns != 0)
+	{
+		if (turns >= periodTurns)
+			turns -= periodTurns;
+		else if (turns < 0)
+			turns += periodTurns;
+	}
+	return turns;
+}
+
+/**
+ * @brief Get the edge vector of a heading, growing the table if it is not periodic
+ */
+const vec2& HeadingTable::step(int turns)
+{
+	if (periodTurns != 0)
+		return steps[turns];
+	if (turns < lowest)
+	{
+		std::vector<vec2> lower;
+		for (int t = turns; t < lowest; t++)
+			lower.push_back(direction(t));
+		steps.insert(steps.begin(), lower.begin(), lower.end());
+		lowest = turns;
+	}
+	while (turns - lowest >= (int)steps.size())
+		steps.push_back(direction(lowest + steps.size()));
+	return steps[turns - lowest];
+}
+
+/**
+ * @brief Compute the edge vector of a heading, reducing the heading to one
+ * circle first so that deep branches get the same precision as the trunk
+ */
+vec2 HeadingTable::direction(int turns) const
+{
+	double degrees = std::fmod((double)turns * angle, 360.0);
+	double rads = degrees * M_PI / 180.0;
+	return vec2{ (GLfloat)(-sin(rads) * length), (GLfloat)(cos(rads) * length) };
+}
+
+
+/**
+ * @brief Draw an edge of length gl_len along the heading and move the turtle to its end.
+ * Rotating (0, gl_len) about the start point by the heading comes down to adding
+ * the step of the heading, which is looked up in headings.
+ */
+void createEdge()
+{
+	const vec2& step = headings.step(turtle.turns);
+	point3 end{ turtle.position.x + step.x, turtle.position.y + step.y, 0.0 };
+	edges.push_back({ turtle.position, end });
+	turtle.position = end;
+}
+
+
+/**
+ * @brief Merge every edge into the one before it when it continues it in the
+ * same direction (F=FF makes long runs of them) and then drop edges drawn
+ * exactly twice. Both passes are linear and compact lines in place.
+ * @return number of edges removed
+ */
+size_t simplifyEdges(std::vector<Edge>& lines)
+{
+	auto bits = [](GLfloat value)
+	{
+		unsigned int result;
+		std::memcpy(&result, &value, sizeof(result));
+		return result;
+	};
+	auto same = [&](const point3& a, const point3& b)
+	{
+		return bits(a.x) == bits(b.x) && bits(a.y) == bits(b.y);
+	};
+
+	size_t count = lines.size();
+	size_t merged = 0;
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		if (merged > 0)
+		{
+			Edge& last = lines[merged - 1];
+			const Edge& line = lines[i];
+			if (same(last.endPoint, line.startPoint))
+			{
+				// the steps of one heading only differ by rounding, the ones of two headings by far more
+				vec2 a{ last.endPoint.x - last.startPoint.x, last.endPoint.y - last.startPoint.y };
+				vec2 b{ line.endPoint.x - line.startPoint.x, line.endPoint.y - line.startPoint.y };
+				GLfloat cross = a.x * b.y - a.y * b.x;
+				if (dot(a, b) > 0 && std::fabs(cross) <= 1e-4f * length(a) * length(b))
+				{
+					last.endPoint = line.endPoint;
+					continue;
+				}
+			}
+		}
+		lines[merged++] = lines[i];
+	}
+	lines.resize(merged);
+
+	struct Segment
+	{
+		unsigned long long a, b; // end points, the smaller one first
+		bool operator==(const Segment& other) const { return a == other.a && b == other.b; }
+	};
+	struct SegmentHash
+	{
+		size_t operator()(const Segment& segment) const
+		{
+			return std::hash<unsigned long long>()(segment.a * 0x9E3779B97F4A7C15ull ^ segment.b);
+		}
+	};
+	std::unordered_set<Segment, SegmentHash> drawn;
+	drawn.reserve(lines.size());
+	size_t kept = 0;
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		const Edge& line = lines[i];
+		unsigned long long start = (unsigned long long)bits(line.startPoint.x) << 32 | bits(line.startPoint.y);
+		unsigned long long end = (unsigned long long)bits(line.endPoint.x) << 32 | bits(line.endPoint.y);
+		if (drawn.insert(Segment{ std::min(start, end), std::max(start, end) }).second)
+			lines[kept++] = line;
+	}
+	printf("L-system simplified : %zu collinear edges merged, %zu duplicates dropped, %zu of %zu edges left\n",
+		count - merged, merged - kept, kept, count);
+	lines.resize(kept);
+	return count - kept;
+}
+
+
+/**
+ * @brief Fill forest with the trees to draw. Without -forest these are the
+ * three trees of the scene, with it forestSize trees on a jittered grid over
+ * the floor, scaled to their cell and standing on it.
+ */
+void plantForest()
+{
+	forest.clear();
+	if (forestSize <= 0)
+	{
+		forest.push_back({ vec3{ 0.0f, 0.0f, 0.0f }, 0.0f, 1.0f, color3{ 1.0f, 1.0f, 1.0f }, 1.0f });
+		forest.push_back({ vec3{ -0.4f, -0.2f, 0.0f }, 0.0f, 0.7f, color3{ 1.0f, 1.0f, 1.0f }, 1.0f });
+		forest.push_back({ vec3{ 0.4f, -0.2f, 0.0f }, 0.0f, 0.7f, color3{ 1.0f, 1.0f, 1.0f }, 1.0f });
+		return;
+	}
+	std::mt19937 random{ 5542 };
+	std::uniform_real_distribution<GLfloat> unit{ 0.0f, 1.0f };
+	int side = (int)std::ceil(std::sqrt((double)forestSize));
+	GLfloat cell = 1.0f / side; // the floor spans [-0.5, 0.5] in x and z
+	forest.reserve(forestSize);
+	for (int i = 0; i < forestSize; i++)
+	{
+		GLfloat scale = cell * (0.5f + 0.5f * unit(random));
+		GLfloat x = -0.5f + cell * (i % side + unit(random));
+		GLfloat z = -0.5f + cell * (i / side + unit(random));
+		// the trees grow from y = -0.5, which is where the floor is
+		vec3 offset{ x, 0.5f * scale - 0.5f, z };
+		GLfloat shade = 0.6f + 0.4f * unit(random);
+		forest.push_back({ offset, unit(random) * 2.0f * (GLfloat)M_PI, scale,
+			color3{ shade * (0.8f + 0.2f * unit(random)), shade, shade * (0.8f + 0.2f * unit(random)) }, 1.0f });
+	}
+}
+
+
+/**
+ * @brief Line strips of every generation 1..N, one after the other, for -lod.
+ * Every generation gets the scale around the root that makes it reach as far
+ * as generation N, so a tree keeps its size whichever generation draws it.
+ * edges ends up holding generation N.
+ */
+void buildLevels(std::vector<LVertex>& vertices, std::vector<GLuint>& indices)
+{
+	const point3 root{ 0, -0.5f, 0.0 };
+	std::vector<GLfloat> extents;
+	std::string current = axiom;
+	headings.reset(angle, gl_len);
+	levels.clear();
+	for (int g = 1; g <= generation; g++)
+	{
+		current = expandTo(1, current);
+		edges.clear();
+		memories.clear();
+		turtle = Memory{ root, 0 };
+		for (auto& symbol : current)
+			interpret(symbol);
+		simplifyEdges(edges);
+
+		std::vector<LVertex> levelVertices;
+		std::vector<GLuint> levelIndices;
+		buildStrips(edges, color, levelVertices, levelIndices);
+		GLfloat extent = 0.0f;
+		for (auto& vertex : levelVertices)
+			extent = std::max(extent, length(vertex.position - root));
+		extents.push_back(extent);
+		levels.push_back({ (GLuint)indices.size(), (GLsizei)levelIndices.size(), 1.0f });
+		GLuint base = (GLuint)vertices.size();
+		for (auto& i : levelIndices)
+			indices.push_back(i == restartIndex ? i : base + i);
+		vertices.insert(vertices.end(), levelVertices.begin(), levelVertices.end());
+	}
+	for (size_t g = 0; g < levels.size(); g++)
+	{
+		levels[g].scale = extents[g] > 0.0f ? extents.back() / extents[g] : 1.0f;
+		printf("L-system level %zu : %d indices, scale %g\n", g + 1, levels[g].indexCount, levels[g].scale);
+	}
+}
+
+
+/**
+ * @brief Draw every tree at the highest generation whose edges still cover
+ * lodPixels on screen. On the way to the next generation the tree fades into
+ * it, drawn at both with the opacities adding up to one. The trees of each
+ * generation go into forestVBO one after the other and are drawn together.
+ */
+void drawLevels(const mat4& model_view)
+{
+	if (levels.empty())
+		return;
+	const point3 root{ 0, -0.5f, 0.0 };
+	// pixels per unit of length at distance 1 from the eye
+	GLfloat pixels = height / (2.0f * tan(fovy * DegreesToRadians / 2.0f));
+	// per generation the trees drawn at it alone and the ones fading between it and another
+	std::vector<std::vector<TreeInstance>> opaque(levels.size()), fading(levels.size());
+	GLfloat c = cos(A * DegreesToRadians), s = sin(A * DegreesToRadians);
+	for (auto& tree : forest)
+	{
+		// where the tree stands in front of the camera, turned like the shader does
+		vec3 position = tree.offset;
+		if (forestSize > 0)
+			position = vec3{ c * position.x + s * position.z, position.y, -s * position.x + c * position.z };
+		vec4 eyePosition = model_view * vec4{ position, 1.0f };
+		GLfloat distance = std::max(-eyePosition.z, zNear);
+		auto edgePixels = [&](size_t g) { return gl_len * levels[g].scale * tree.scale * pixels / distance; };
+
+		size_t g = levels.size() - 1;
+		while (g > 0 && edgePixels(g) < lodPixels)
+			g--;
+		GLfloat fade = 0.0f; // how far the tree is on its way to g + 1
+		if (g + 1 < levels.size() && edgePixels(g) >= lodPixels)
+			fade = std::min(1.0f, std::log(edgePixels(g) / lodPixels) / std::log(edgePixels(g) / edgePixels(g + 1)));
+		TreeInstance instance = tree;
+		instance.fade = 1.0f - fade;
+		if (fade > 0.0f)
+		{
+			fading[g].push_back(instance);
+			instance.fade = fade;
+			fading[g + 1].push_back(instance);
+		}
+		else
+			opaque[g].push_back(instance);
+	}
+	std::vector<TreeInstance> instances;
+	instances.reserve(2 * forest.size());
+	for (auto& trees : opaque)
+		instances.insert(instances.end(), trees.begin(), trees.end());
+	for (auto& trees : fading)
+		instances.insert(instances.end(), trees.begin(), trees.end());
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glState.bindVertexArray(lsystemVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, forestVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(TreeInstance) * instances.size(), instances.data(), GL_STREAM_DRAW);
+	auto drawLevel = [&](size_t g, const std::vector<TreeInstance>& trees, size_t first)
+	{
+		if (trees.empty())
+			return;
+		size_t start = sizeof(TreeInstance) * first;
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(start + offsetof(TreeInstance, offset)));
+		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(start + offsetof(TreeInstance, rotation)));
+		glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(TreeInstance), BUFFER_OFFSET(start + offsetof(TreeInstance, tint)));
+		// scale generation g around the root on top of the dequantization
+		GLfloat scale = levels[g].scale;
+		lsystemShader.set(lsystem.positionScale, vec3(lsystemScale.x * scale, lsystemScale.y * scale, lsystemScale.z));
+		lsystemShader.set(lsystem.positionOffset, vec3(root.x + (lsystemOffset.x - root.x) * scale,
+			root.y + (lsystemOffset.y - root.y) * scale, lsystemOffset.z));
+		glDrawElementsInstanced(GL_LINE_STRIP, levels[g].indexCount, GL_UNSIGNED_INT,
+			BUFFER_OFFSET(sizeof(GLuint) * levels[g].firstIndex), (GLsizei)trees.size());
+	};
+	size_t first = 0;
+	for (size_t g = 0; g < levels.size(); g++)
+	{
+		drawLevel(g, opaque[g], first);
+		first += opaque[g].size();
+	}
+	// the two generations of a fading tree overlap, at least in the trunk, so
+	// they are blended without writing depth or the second would fail the test
+	// against the first, then written to depth alone for what is drawn after them
+	size_t firstFading = first;
+	glDepthMask(GL_FALSE);
+	for (size_t g = 0; g < levels.size(); g++)
+	{
+		drawLevel(g, fading[g], first);
+		first += fading[g].size();
+	}
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	first = firstFading;
+	for (size_t g = 0; g < levels.size(); g++)
+	{
+		drawLevel(g, fading[g], first);
+		first += fading[g].size();
+	}
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisable(GL_BLEND);
+}
+
+
+
+/**
+ * @brief Draw the trees of the l-system, expanded or from leaf meshes, and
+ * the picked branch over them. The program and TreesObject are set already.
+ */
+void drawTrees(const mat4& model_view, const mat4& projection)
+{
+	if (leafGenerations < 0)
+	{
+		lsystemShader.set(lsystem.positionScale, lsystemScale);
+		lsystemShader.set(lsystem.positionOffset, lsystemOffset);
+		// the default trees spin in place, a forest turns with the floor
+		lsystemShader.set(lsystem.treeRotation, forestSize > 0 ? 0.0f : A * DegreesToRadians);
+		lsystemShader.set(lsystem.forestRotation, forestSize > 0 ? A * DegreesToRadians : 0.0f);
+		if (lsystem.vColor >= 0)
+			glVertexAttrib3fv(lsystem.vColor, color); // when the l-system has no color array
+		if (levelsOfDetail)
+			drawLevels(model_view);
+		else if (culling)
+			drawCulled(model_view, projection);
+		else
+			glDrawElementsInstanced(GL_LINE_STRIP, lsystemIndexCount, GL_UNSIGNED_INT, BUFFER_OFFSET(0), (GLsizei)forest.size());
+	}
+	else
+	{
+		// one instanced draw per leaf mesh and tree, the tree comes in as constant attributes
+		hierarchyShader.set(hierarchyLocations.treeRotation, forestSize > 0 ? 0.0f : A * DegreesToRadians);
+		hierarchyShader.set(hierarchyLocations.forestRotation, forestSize > 0 ? A * DegreesToRadians : 0.0f);
+		hierarchyShader.set(hierarchyLocations.angle, angle * DegreesToRadians);
+		hierarchyShader.set(hierarchyLocations.steps, hierarchy.steps);
+		hierarchyShader.set(hierarchyLocations.root, hierarchy.root);
+		glState.bindTexture(1, GL_TEXTURE_BUFFER, hierarchyTexture);
+		for (auto& tree : forest)
+		{
+			glVertexAttrib3fv(2, tree.offset);
+			glVertexAttrib2f(3, tree.rotation, tree.scale);
+			glVertexAttrib3fv(5, tree.tint);
+			for (size_t i = 0; i < hierarchy.leaves.size(); i++)
+			{
+				const LSystemHierarchy::Leaf& mesh = hierarchy.leaves[i];
+				hierarchyShader.set(hierarchyLocations.leaf, (GLuint)i);
+				glDrawElementsInstanced(GL_LINE_STRIP, mesh.indexCount, GL_UNSIGNED_INT,
+					BUFFER_OFFSET(sizeof(GLuint) * mesh.firstIndex), mesh.instances);
+			}
+		}
+	}
+
+	if (leafGenerations < 0 && picked.tree >= 0 && picked.tree < (long long)forest.size())
+	{
+		// the picked branch once more over itself, tinted magenta
+		const TreeInstance& tree = forest[picked.tree];
+		glState.bindVertexArray(lsystemVAO);
+		glDisableVertexAttribArray(2);
+		glDisableVertexAttribArray(3);
+		glDisableVertexAttribArray(5);
+		glVertexAttrib3fv(2, tree.offset);
+		glVertexAttrib2f(3, tree.rotation, tree.scale);
+		glVertexAttrib4f(5, 1.5f, 0.2f, 1.5f, 1.0f);
+		glState.depthFunc(GL_LEQUAL);
+		glDrawElements(GL_LINE_STRIP, picked.indexCount, GL_UNSIGNED_INT, BUFFER_OFFSET(sizeof(GLuint) * picked.firstIndex));
+		glState.depthFunc(GL_LESS);
+		glEnableVertexAttribArray(2);
+		glEnableVertexAttribArray(3);
+		glEnableVertexAttribArray(5);
+		glVertexAttrib4f(5, 1.0f, 1.0f, 1.0f, 1.0f);
+	}
+}
+
+/**
+ * @brief Model matrix of a tree, the same transformation vshader_lsystem.glsl applies
+ */
+mat4 treeModel(const TreeInstance& tree)
+{
+	GLfloat treeRotation = forestSize > 0 ? 0.0f : A;
+	GLfloat forestRotation = forestSize > 0 ? A : 0.0f;
+	return Rotate(forestRotation, 0.0f, 1.0f, 0.0f) * Translate(tree.offset)
+		* Rotate(tree.rotation / DegreesToRadians + treeRotation, 0.0f, 1.0f, 0.0f) * Scale(tree.scale, tree.scale, tree.scale);
+}
+
+
+/**
+ * @brief Draw every tree with one glMultiDrawElements of the ranges of it
+ * lsystemBVH finds in view, the tree coming in as constant attributes
+ */
+void drawCulled(const mat4& model_view, const mat4& projection)
+{
+	std::vector<GLsizei> counts;
+	std::vector<GLuint> firsts;
+	std::vector<const void*> offsets;
+	size_t visited = 0;
+	glState.bindVertexArray(lsystemVAO);
+	glDisableVertexAttribArray(2);
+	glDisableVertexAttribArray(3);
+	glDisableVertexAttribArray(5);
+	for (auto& tree : forest)
+	{
+		counts.clear();
+		firsts.clear();
+		lsystemBVH.cull(projection * model_view * treeModel(tree), counts, firsts, visited);
+		if (counts.empty())
+			continue;
+		offsets.resize(firsts.size());
+		for (size_t i = 0; i < firsts.size(); i++)
+			offsets[i] = BUFFER_OFFSET(sizeof(GLuint) * firsts[i]);
+		glVertexAttrib3fv(2, tree.offset);
+		glVertexAttrib2f(3, tree.rotation, tree.scale);
+		glVertexAttrib4f(5, tree.tint.x, tree.tint.y, tree.tint.z, tree.fade);
+		glMultiDrawElements(GL_LINE_STRIP, counts.data(), GL_UNSIGNED_INT, offsets.data(), (GLsizei)counts.size());
+	}
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glEnableVertexAttribArray(5);
+	glVertexAttrib4f(5, 1.0f, 1.0f, 1.0f, 1.0f);
+}
+
+
+/**
+ * @brief Pick the edge nearest to the camera within a few pixels of window
+ * point (x, y) over all trees and highlight its branch
+ */
+void pickBranch(int x, int y)
+{
+	if (lsystemIndices.empty())
+		return;
+	mat4 p = Perspective(fovy, aspect, zNear, zFar);
+	vec4 at(0.0f, 0.0f, 0.0f, 1.0f);
+	vec4 up(0.0f, 1.0f, 0.0f, 0.0f);
+	vec4 eye(0.0, 0.0, 1.0f, 1.0);
+	mat4 model_view = LookAt(eye, at, up) * Translate(X, 0.0f, Z);
+	// window to normalized device coordinates, with 4 pixels of slack
+	GLfloat ndcX = 2.0f * x / width - 1.0f, ndcY = 1.0f - 2.0f * y / height;
+	GLfloat tolerance = 8.0f / std::min(width, height);
+
+	picked.tree = -1;
+	GLfloat nearest = FLT_MAX;
+	for (size_t t = 0; t < forest.size(); t++)
+	{
+		GLfloat depth;
+		long long edge = lsystemBVH.pick(p * model_view * treeModel(forest[t]), ndcX, ndcY, tolerance, depth);
+		if (edge >= 0 && depth < nearest)
+		{
+			nearest = depth;
+			picked.tree = (long long)t;
+			lsystemBVH.branch((size_t)edge, picked.firstIndex, picked.indexCount);
+		}
+	}
+	if (picked.tree >= 0)
+		printf("Picked a branch of tree %lld, %d indices\n", picked.tree, picked.indexCount);
+	glutPostRedisplay();
+}
+
+
+/**
+ * @brief Build the hierarchy over lines, whose line strips are indices
+ */
+void LSystemBVH::build(const std::vector<Edge>& lines, const std::vector<GLuint>& indices)
+{
+	this->lines = &lines;
+	this->indices = &indices;
+	// every index after the first of a strip is the end of the next edge
+	ends.clear();
+	ends.reserve(lines.size());
+	for (size_t i = 1; i < indices.size(); i++)
+		if (indices[i] != restartIndex && indices[i - 1] != restartIndex)
+			ends.push_back((GLuint)i);
+	nodes.clear();
+	nodes.reserve(2 * (lines.size() / leafSize + 1));
+	if (!lines.empty())
+		buildNode(0, (GLuint)lines.size());
+}
+
+int LSystemBVH::buildNode(GLuint first, GLuint count)
+{
+	int id = (int)nodes.size();
+	nodes.push_back({});
+	Node node{ vec2{ FLT_MAX, FLT_MAX }, vec2{ -FLT_MAX, -FLT_MAX }, first, count, -1, -1 };
+	if (count > leafSize)
+	{
+		// split in the middle, moved to the nearest branch start within an eighth of the range
+		GLuint middle = first + count / 2;
+		for (GLuint d = 0; d < count / 8; d++)
+		{
+			if (ends[middle - d] - ends[middle - d - 1] != 1)
+			{
+				middle -= d;
+				break;
+			}
+			if (ends[middle + d] - ends[middle + d - 1] != 1)
+			{
+				middle += d;
+				break;
+			}
+		}
+		node.left = buildNode(first, middle - first);
+		node.right = buildNode(middle, first + count - middle);
+		for (int child : { node.left, node.right })
+		{
+			node.low.x = std::min(node.low.x, nodes[child].low.x);
+			node.low.y = std::min(node.low.y, nodes[child].low.y);
+			node.high.x = std::max(node.high.x, nodes[child].high.x);
+			node.high.y = std::max(node.high.y, nodes[child].high.y);
+		}
+	}
+	else
+	{
+		for (GLuint i = first; i < first + count; i++)
+		{
+			for (const point3& point : { (*lines)[i].startPoint, (*lines)[i].endPoint })
+			{
+				node.low.x = std::min(node.low.x, point.x);
+				node.low.y = std::min(node.low.y, point.y);
+				node.high.x = std::max(node.high.x, point.x);
+				node.high.y = std::max(node.high.y, point.y);
+			}
+		}
+	}
+	nodes[id] = node;
+	return id;
+}
+
+/**
+ * @brief Append the index range of edges [first, first + count) to counts and
+ * firsts, merged with the range before it when they touch
+ */
+void LSystemBVH::emit(GLuint first, GLuint count, std::vector<GLsizei>& counts, std::vector<GLuint>& firsts) const
+{
+	// the start point of an edge is the index right before its end point
+	GLuint begin = ends[first] - 1, end = ends[first + count - 1] + 1;
+	if (!firsts.empty() && begin <= firsts.back() + counts.back() + 1)
+	{
+		// the restart index between them, if any, is drawn as well and splits the strips
+		counts.back() = (GLsizei)(end - firsts.back());
+		return;
+	}
+	firsts.push_back(begin);
+	counts.push_back((GLsizei)(end - begin));
+}
+
+/**
+ * @brief Find the index ranges of the edges inside the view frustum of mvp
+ * @param visited incremented by the number of nodes tested
+ */
+void LSystemBVH::cull(const mat4& mvp, std::vector<GLsizei>& counts, std::vector<GLuint>& firsts, size_t& visited) const
+{
+	if (nodes.empty())
+		return;
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		visited++;
+		// the box is flat, so its four corners are enough
+		int outside[6] = {};
+		int inside = 0;
+		for (int corner = 0; corner < 4; corner++)
+		{
+			vec4 clip = mvp * vec4{ corner & 1 ? node.high.x : node.low.x, corner & 2 ? node.high.y : node.low.y, 0.0f, 1.0f };
+			outside[0] += clip.x < -clip.w;
+			outside[1] += clip.x > clip.w;
+			outside[2] += clip.y < -clip.w;
+			outside[3] += clip.y > clip.w;
+			outside[4] += clip.z < -clip.w;
+			outside[5] += clip.z > clip.w;
+			inside += clip.x >= -clip.w && clip.x <= clip.w && clip.y >= -clip.w && clip.y <= clip.w
+				&& clip.z >= -clip.w && clip.z <= clip.w;
+		}
+		if (std::find(outside, outside + 6, 4) != outside + 6)
+			continue;
+		if (inside == 4 || node.left < 0)
+		{
+			emit(node.first, node.count, counts, firsts);
+			continue;
+		}
+		// right first so the ranges come out in order
+		stack[top++] = node.right;
+		stack[top++] = node.left;
+	}
+}
+
+/**
+ * @brief Find the edge nearest to the camera that passes within tolerance of
+ * the point (x, y) in normalized device coordinates
+ * @param depth receives the depth of the edge there
+ * @return the edge, or -1 if there is none
+ */
+long long LSystemBVH::pick(const mat4& mvp, GLfloat x, GLfloat y, GLfloat tolerance, GLfloat& depth) const
+{
+	long long best = -1;
+	depth = FLT_MAX;
+	if (nodes.empty())
+		return best;
+	auto project = [&](GLfloat px, GLfloat py, vec3& ndc)
+	{
+		vec4 clip = mvp * vec4{ px, py, 0.0f, 1.0f };
+		if (clip.w <= zNear * 0.5f)
+			return false;
+		ndc = vec3{ clip.x / clip.w, clip.y / clip.w, clip.z / clip.w };
+		return true;
+	};
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = nodes[stack[--top]];
+		// the screen rectangle of the box, or the whole screen when it reaches behind the camera
+		vec2 low{ FLT_MAX, FLT_MAX }, high{ -FLT_MAX, -FLT_MAX };
+		for (int corner = 0; corner < 4; corner++)
+		{
+			vec3 ndc;
+			if (!project(corner & 1 ? node.high.x : node.low.x, corner & 2 ? node.high.y : node.low.y, ndc))
+			{
+				low = vec2{ -FLT_MAX, -FLT_MAX };
+				high = vec2{ FLT_MAX, FLT_MAX };
+				break;
+			}
+			low.x = std::min(low.x, ndc.x);
+			low.y = std::min(low.y, ndc.y);
+			high.x = std::max(high.x, ndc.x);
+			high.y = std::max(high.y, ndc.y);
+		}
+		if (x < low.x - tolerance || x > high.x + tolerance || y < low.y - tolerance || y > high.y + tolerance)
+			continue;
+		if (node.left >= 0)
+		{
+			stack[top++] = node.right;
+			stack[top++] = node.left;
+			continue;
+		}
+		for (GLuint i = node.first; i < node.first + node.count; i++)
+		{
+			vec3 a, b;
+			const Edge& line = (*lines)[i];
+			if (!project(line.startPoint.x, line.startPoint.y, a) || !project(line.endPoint.x, line.endPoint.y, b))
+				continue;
+			// distance from the point to the segment on screen
+			vec2 ab{ b.x - a.x, b.y - a.y }, ap{ x - a.x, y - a.y };
+			GLfloat along = dot(ab, ab) > 0.0f ? std::max(0.0f, std::min(1.0f, dot(ap, ab) / dot(ab, ab))) : 0.0f;
+			vec2 closest{ a.x + along * ab.x - x, a.y + along * ab.y - y };
+			GLfloat z = a.z + along * (b.z - a.z);
+			if (length(closest) <= tolerance && z < depth)
+			{
+				depth = z;
+				best = i;
+			}
+		}
+	}
+	return best;
 }
 
-
-void init()
+/**
+ * @brief Index range of the branch edge grows on : its line strip and every
+ * strip that branches off it later. Vertices are numbered in the order they
+ * are drawn, so the branch ends at the first strip starting at a vertex older
+ * than its own.
+ */
+void LSystemBVH::branch(size_t edge, GLuint& firstIndex, GLsizei& indexCount) const
 {
-	// Load shaders and create a shader lsystemShader (to be used in display())
-	lsystemShader = InitShader("vshader_lsystem.glsl", "fshader_lsystem.glsl");
-	skyboxShader = InitShader("vshader_skybox.glsl", "fshader_skybox.glsl");
-	cubeShader = InitShader("vshader_cube.glsl", "fshader_cube.glsl");
-	lightCubeShader = InitShader("vshader_lightCube.glsl", "fshader_lightCube.glsl");
-	lightShader = InitShader("vshader_light.glsl", "fshader_light.glsl");
-
+	auto restarts = [&](size_t e) { return e == 0 || ends[e] - ends[e - 1] != 1; };
+	size_t first = edge;
+	while (!restarts(first))
+		first--;
+	GLuint own = (*indices)[ends[first]]; // first vertex of the branch
+	size_t last = first + 1;
+	while (last < ends.size() && !(restarts(last) && (*indices)[ends[last] - 1] < own))
+		last++;
+	firstIndex = ends[first] - 1;
+	indexCount = (GLsizei)(ends[last - 1] + 1 - firstIndex);
+}
 
-	// Initialize the l-system rules
-	LSystemRules();
-	// Initialize the l-system string
-	LSystemString();
-	// Initialize the vertex data for the gl_len-system
-	LSystem();
 
-	for (int i = 0; i < edges.size(); i++)
+/**
+ * @brief Quantize the positions of vertices to 16 bits over their bounding box.
+ * The vertex shader gets them back as position * scale + offset.
+ */
+void quantizeVertices(const std::vector<LVertex>& vertices, std::vector<QVertex>& out, vec3& scale, vec3& offset)
+{
+	vec2 low{ FLT_MAX, FLT_MAX }, high{ -FLT_MAX, -FLT_MAX };
+	for (auto& vertex : vertices)
 	{
-		Edge edge = edges[i];
-		l_system_points.push_back(edge.startPoint);
-		l_system_colors.push_back(color);
-		l_system_points.push_back(edge.endPoint);
-		l_system_colors.push_back(color);
+		low.x = std::min(low.x, vertex.position.x);
+		low.y = std::min(low.y, vertex.position.y);
+		high.x = std::max(high.x, vertex.position.x);
+		high.y = std::max(high.y, vertex.position.y);
 	}
+	fitQuantization(low, high, scale, offset);
+	out.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+		out[i] = quantize(vertices[i].position, scale, offset);
+	printf("L-system quantized : %zu bytes of vertices instead of %zu, steps of %g x %g\n",
+		sizeof(QVertex) * out.size(), sizeof(LVertex) * vertices.size(), scale.x / 32767.0f, scale.y / 32767.0f);
+}
 
-	// Initialize the vertex data for the floor
-	floor();
-	// Step 1: Generate and bind the VAO for the floor
-	glGenVertexArrays(1, &floorVAO);
-	glBindVertexArray(floorVAO);
-	// Step 2: Generate the VBO for the floor
-	glGenBuffers(1, &floorVBO);
-	// Step 3: Bind the VBO with the GL_ARRAY_BUFFER buffer type
-	glBindBuffer(GL_ARRAY_BUFFER, floorVBO);
-	// Step 4: Copy the vertex data to the VBO
-	glBufferData(GL_ARRAY_BUFFER, sizeof(floor_points) + sizeof(floor_colors),
-		NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(floor_points), floor_points);
-	glBufferSubData(GL_ARRAY_BUFFER, sizeof(floor_points), sizeof(floor_colors), floor_colors);
-	// Step 5: Connect the VBO to the vertex attributes in the shader
-	// (get position, interpret the vertex data, and enable the vertex attributes)
-	GLuint vPosition = glGetAttribLocation(lsystemShader, "vPosition");
-	glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-	glEnableVertexAttribArray(vPosition);
-	GLuint vColor = glGetAttribLocation(lsystemShader, "vColor");
-	glVertexAttribPointer(vColor, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(point3) * floor_NumVertices));
-	glEnableVertexAttribArray(vColor);
-	// (optional) Step 6: unbind VAO and VBO
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-
-	// Step 1: Generate and bind the VAO for the lines
-	glGenVertexArrays(1, &lsystemVAO);
-	glBindVertexArray(lsystemVAO);
-	// Step 2: Generate the VBO for the lines
-	glGenBuffers(1, &lsystemVBO);
-	// Step 3: Bind the VBO with the GL_ARRAY_BUFFER buffer type
-	glBindBuffer(GL_ARRAY_BUFFER, lsystemVBO);
-	// Step 4: Copy the vertex data to the VBO
-	glBufferData(GL_ARRAY_BUFFER,
-		sizeof(point3) * l_system_points.size() + sizeof(point3) * l_system_colors.size(),
-		NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0,
-		sizeof(point3) * l_system_points.size(), l_system_points.data());
-	glBufferSubData(GL_ARRAY_BUFFER,
-		sizeof(point3) * l_system_points.size(),
-		sizeof(point3) * l_system_colors.size(),
-		l_system_colors.data());
-	glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-	glEnableVertexAttribArray(vPosition);
-	glVertexAttribPointer(vColor, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(point3) * l_system_points.size()));
-	glEnableVertexAttribArray(vColor);
-	// (optional) Step 6: unbind VAO and VBO
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-
-	// cube1 VAO
-	glGenVertexArrays(1, &cube1VAO);
-	glGenBuffers(1, &cube1VBO);
-	glBindVertexArray(cube1VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, cube1VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), &cubeVertices, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-	cube1Texture = loadTexture("cube/Christmas.jpg");
-	glUseProgram(cubeShader);
-	glUniform1i(glGetUniformLocation(cubeShader, "texture1"), 0);
-
-	// cube2 VAO
-	glGenVertexArrays(1, &cube2VAO);
-	glGenBuffers(1, &cube2VBO);
-	glBindVertexArray(cube2VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, cube2VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeVertices), &cubeVertices, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-	cube2Texture = loadTexture("cube/Christmas2.jpg");
-
-	// diffuse light
-	glGenVertexArrays(1, &lightCubeVAO);
-	glGenBuffers(1, &lightCubeVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, lightCubeVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(lightcubevertices), lightcubevertices, GL_STATIC_DRAW);
-	glBindVertexArray(lightCubeVAO);
-	// position attribute
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-	// normal attribute
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
-	// second, configure the light's VAO (VBO stays the same; the vertices are the same for the light object which is also a 3D cube)
-	glGenVertexArrays(1, &lightVAO);
-	glBindVertexArray(lightVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, lightCubeVBO);
-	// note that we update the lamp's position attribute's stride to reflect the updated buffer data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-
-	//  Generate and bind the VAO for the skybox
-	glGenVertexArrays(1, &skyboxVAO);
-	glGenBuffers(1, &skyboxVBO);
-	glBindVertexArray(skyboxVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-
-	cubemapTexture = loadCubemap(faces);
-
-	glUseProgram(skyboxShader);
-	glUniform1i(glGetUniformLocation(skyboxShader, "skybox"), 0);
+/**
+ * @brief Quantization of the positions in the box [low, high]
+ */
+void fitQuantization(const vec2& low, const vec2& high, vec3& scale, vec3& offset)
+{
+	// normalized shorts cover [-1, 1], so the box is mapped around its center
+	offset = vec3{ (low.x + high.x) / 2, (low.y + high.y) / 2, 0.0f };
+	scale = vec3{ std::max((high.x - low.x) / 2, FLT_MIN), std::max((high.y - low.y) / 2, FLT_MIN), 1.0f };
+}
 
-	glEnable(GL_DEPTH_TEST);
-	glClearColor(0.0, 0.0, 0.0, 1.0);
-	glLineWidth(2.0);
-	glPointSize(3.0);
-	glClear(GL_COLOR_BUFFER_BIT);
+/**
+ * @brief position quantized with scale and offset of fitQuantization()
+ */
+QVertex quantize(const point3& position, const vec3& scale, const vec3& offset)
+{
+	return QVertex{ (GLshort)std::lround((position.x - offset.x) / scale.x * 32767.0f),
+		(GLshort)std::lround((position.y - offset.y) / scale.y * 32767.0f) };
 }
 
 
+/**
+ * @brief Turn the edges into line strips separated by restartIndex.
+ * An edge starting where the one before it ended continues the strip, any other
+ * edge starts a branch at a point the turtle has already drawn, so every
+ * point is stored once. Only the points branches start from are looked up,
+ * the first pass collects them. Points interpretParallel() recomputed at a
+ * chunk boundary can differ in the last bits and get a vertex of their own.
+ * Every vertex gets the color tint.
+ */
+void buildStrips(const std::vector<Edge>& lines, const color3& tint, std::vector<LVertex>& vertices, std::vector<GLuint>& indices)
+{
+	vertices.clear();
+	vertices.reserve(stripVertexBound(lines));
+	buildStrips(lines, indices, [&](const point3& point) { vertices.push_back({ point, tint }); });
+}
 
-void display()
+/**
+ * @brief Key of a point for the lookups of buildStrips(), its x and y bits
+ */
+unsigned long long stripKey(const point3& point)
 {
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	unsigned int x, y;
+	std::memcpy(&x, &point.x, sizeof(x));
+	std::memcpy(&y, &point.y, sizeof(y));
+	return (unsigned long long)x << 32 | y;
+}
 
-	/*---  Set up and pass on Projection matrix to the shader ---*/
-	mat4 p = Perspective(fovy, aspect, zNear, zFar);
-	/*---  Set up and pass on Model-View matrix to the shader ---*/
-	vec4 at(0.0f, 0.0f, 0.0f, 1.0f);
-	vec4 up(0.0f, 1.0f, 0.0f, 0.0f);
-	vec4 eye(0.0, 0.0, 1.0f, 1.0); // negative Z (for skybox)
+/**
+ * @brief Most vertices buildStrips() makes of lines : one per edge and one
+ * per branch, if the point it starts from was not drawn before
+ */
+size_t stripVertexBound(const std::vector<Edge>& lines)
+{
+	size_t bound = lines.size();
+	for (size_t i = 0; i < lines.size(); i++)
+		if (i == 0 || stripKey(lines[i].startPoint) != stripKey(lines[i - 1].endPoint))
+			bound++;
+	return bound;
+}
 
-	glUseProgram(lsystemShader); 
-	GLuint view = glGetUniformLocation(lsystemShader, "view");
-	GLuint projection = glGetUniformLocation(lsystemShader, "projection");
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p);
-	/*----- Set up the Mode-View matrix for the floor -----*/
-	mat4 model_view = LookAt(eye, at, up) * Translate(X, 0.0f, 0.0f + Z) * Rotate(0.0f + A, 0.0f, 2.0f, 0.0f) * Scale(1.0f, 1.0f, 1.0f); // rotated and translated
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-
-	// draw the floor
-	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	glBindVertexArray(floorVAO);
-	glDrawArrays(GL_TRIANGLES, 0, floor_NumVertices);
-
-	// draw the l-system
-	glBindVertexArray(lsystemVAO);
-	glDrawArrays(GL_LINES, 0, l_system_points.size());
-
-	// extra
-	model_view = LookAt(eye, at, up) * Translate(X - 0.4f , -0.2f, Z) * Rotate(0.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.7f, 0.7f, 0.7f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(lsystemVAO);
-	glDrawArrays(GL_LINES, 0, l_system_points.size());
-		
-	model_view = LookAt(eye, at, up) * Translate(X + 0.4f, -0.2f, Z) * Rotate(0.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.7f, 0.7f, 0.7f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(lsystemVAO);
-	glDrawArrays(GL_LINES, 0, l_system_points.size());
-
-	// draw cubes
-	glUseProgram(cubeShader);
-	view = glGetUniformLocation(cubeShader, "view");
-	projection = glGetUniformLocation(cubeShader, "projection");
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p);
-	model_view = LookAt(eye, at, up) * Translate(X + 1.5f, -0.45f, -1.0f + Z) * Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(cube1VAO);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, cube1Texture);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
-	// cube 2
-	model_view = LookAt(eye, at, up) * Translate(X - 1.5f, -0.45f, -1.0f + Z) * Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(cube2VAO);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, cube2Texture);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+/**
+ * @brief buildStrips() handing every new vertex to emit(point) instead of
+ * storing it, so the caller can write it straight into a mapped buffer. The
+ * vertex is the one of index n on the n-th call.
+ * @return the number of vertices emitted, at most stripVertexBound(lines)
+ */
+template <typename Emit>
+size_t buildStrips(const std::vector<Edge>& lines, std::vector<GLuint>& indices, Emit emit)
+{
+	auto continues = [&](size_t i)
+	{
+		return i > 0 && stripKey(lines[i].startPoint) == stripKey(lines[i - 1].endPoint);
+	};
 
-	// cube for diffuse light
-	glUseProgram(lightCubeShader);
-	glUniform3f(glGetUniformLocation(lightCubeShader, "objectColor"), 0.5f, 1.0f, 0.3f);
-	glUniform3f(glGetUniformLocation(lightCubeShader, "lightColor"), 1.0f, 1.0f, 1.0f);
-	glUniform3f(glGetUniformLocation(lightCubeShader, "lightPos"), 1.2f, 1.0f, 2.0f);
-	glUniformMatrix4fv(glGetUniformLocation(lightCubeShader, "model"), 1, GL_FALSE, mat4(1));
-	view = glGetUniformLocation(lightCubeShader, "view");
-	projection = glGetUniformLocation(lightCubeShader, "projection");
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p);
-	model_view = LookAt(eye, at, up) * Translate(0.0f, 0.0f, -2.0f) * Rotate(0.0f + AA, 0.0f, 2.0f, 0.0f) * Scale(0.5f, 0.5f, 0.5f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(lightCubeVAO);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+	std::unordered_map<unsigned long long, GLuint> branches;
+	for (size_t i = 0; i < lines.size(); i++)
+		if (!continues(i))
+			branches.emplace(stripKey(lines[i].startPoint), restartIndex);
 
-	// light 
-	glUseProgram(lightShader);
-	view = glGetUniformLocation(lightShader, "view");
-	projection = glGetUniformLocation(lightShader, "projection");
-	glUniformMatrix4fv(glGetUniformLocation(lightShader, "model"), 1, GL_FALSE, mat4(1));
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p);
-	model_view = LookAt(eye, at, up) * Translate(0.8f, 1.0f, -2.0f) * Rotate(0.0f, 0.0f, 2.0f, 0.0f) * Scale(0.3f, 0.3f, 0.3f);
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	glBindVertexArray(lightVAO);
-	glDrawArrays(GL_TRIANGLES, 0, 36);
-	glBindVertexArray(0);
+	indices.clear();
+	indices.reserve(lines.size() + 2 * branches.size());
+	GLuint count = 0;
+	auto add = [&](const point3& point)
+	{
+		GLuint index = count++;
+		emit(point);
+		auto branch = branches.find(stripKey(point));
+		if (branch != branches.end())
+			branch->second = index;
+		return index;
+	};
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		const Edge& line = lines[i];
+		if (!continues(i))
+		{
+			if (i > 0)
+				indices.push_back(restartIndex);
+			GLuint start = branches[stripKey(line.startPoint)];
+			// a branch always starts at a drawn point, except for the first one
+			indices.push_back(start != restartIndex ? start : add(line.startPoint));
+		}
+		indices.push_back(add(line.endPoint));
+	}
+	return count;
+}
 
-	// draw skybox as last 
-	glDepthFunc(GL_LEQUAL); // change depth function so depth test passes when values are equal to depth buffer's content
-	glUseProgram(skyboxShader); 
-	view = glGetUniformLocation(skyboxShader, "view");
-	projection = glGetUniformLocation(skyboxShader, "projection");
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p);
-	model_view = mat4WithUpperLeftMat3(upperLeftMat3(LookAt(eye, at, up) * Rotate(180.0f + A, 0.0f, 2.0f, 0.0f) * Scale(1.0f, 1.0f, 1.0f))); // remove translation from the view matrix
-	glUniformMatrix4fv(view, 1, GL_TRUE, model_view);
-	// bind both textures to the corresponding texture unit
-	glBindVertexArray(skyboxVAO);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
-	glDrawArrays(GL_TRIANGLES, 0, skybox_NumVertices);
-	glBindVertexArray(0);
-	glDepthFunc(GL_LESS); // set depth function back to default
+void rotateLeft()
+{
+	turtle.turns = headings.turn(turtle.turns, 1);
+}
 
-	glutSwapBuffers();
+void rotateRight()
+{
+	turtle.turns = headings.turn(turtle.turns, -1);
 }
 
-void reshape(int w, int h)
+void push()
 {
-	glViewport(0, 0, width, height);
-	aspect = (GLfloat)width / (GLfloat)height;
-	glutPostRedisplay();
+	memories.push_back(turtle);
 }
 
-void idle()
+void pop()
 {
-	AA += 0.03f;
-	glutPostRedisplay();
+	turtle = memories.back();
+	memories.pop_back();
 }
 
-void keyboard(unsigned char key, int x, int y)
+
+/**
+ * @brief Rewrite one generation the way LSystemString() did before the
+ * grammar tables, with map lookups and appends. Only kept for runBenchmarks().
+ */
+void rewriteWithMap(const std::string& source, std::string& target)
 {
-	switch (key)
+	target.clear();
+	for (auto& symbol : source)
 	{
-	case 'w':
-	case 'W':
-		Z += 0.1f;
-		break;
-
-	case 'a':
-	case 'A':
-		X += 0.1f;
-		break;
+		if (grammers.count(symbol))
+			target += grammers[symbol];
+		else
+			target += symbol;
+	}
+}
 
-	case 's':
-	case 'S':
-		Z -= 0.1f;
-		break;
 
-	case 'd':
-	case 'D':
-		X -= 0.1f;
-		break;
+/**
+ * @brief Time the rewriting of every generation up to the requested one,
+ * with the map-based loop against the table-based rewrite()
+ */
+void benchmarkLSystemString()
+{
+	unsigned int threads = numThreads;
+	printf("L-system rewriting (ms per generation)\n");
+	printf("%4s %12s %10s %10s %10s\n", "gen", "symbols", "map", "table", "threads");
+	std::vector<LSystemSize> sizes = predictLSystem(generation);
+	std::string source = axiom, mapTarget, tableTarget;
+	for (int i = 1; i <= generation; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		rewriteWithMap(source, mapTarget);
+		auto mapEnd = std::chrono::steady_clock::now();
+		numThreads = 1;
+		rewrite(source, tableTarget);
+		auto tableEnd = std::chrono::steady_clock::now();
+		numThreads = threads;
+		rewrite(source, tableTarget);
+		auto threadsEnd = std::chrono::steady_clock::now();
+		if (mapTarget != tableTarget)
+			printf("generation %d differs between the map and the table!\n", i);
+		if (sizes[i].symbols != tableTarget.size() ||
+			sizes[i].edges != (unsigned long long)std::count(tableTarget.begin(), tableTarget.end(), 'F'))
+			printf("generation %d differs from its predicted size!\n", i);
+		printf("%4d %12zu %10.3f %10.3f %10.3f\n", i, tableTarget.size(),
+			std::chrono::duration<double, std::milli>(mapEnd - start).count(),
+			std::chrono::duration<double, std::milli>(tableEnd - mapEnd).count(),
+			std::chrono::duration<double, std::milli>(threadsEnd - tableEnd).count());
+		source.swap(tableTarget);
+	}
+}
 
-	case ' ':
-		X = 0.0f;
-		Z = 0.0f;
-		break;
 
-	case 033: // Escape Key
-	case 'q':
-	case 'Q':
-		exit(EXIT_SUCCESS);
+/**
+ * @brief Run the benchmarks selected by -bench and print their results
+ */
+void runBenchmarks()
+{
+	LSystemRules();
+	benchmarkLSystemString();
+	benchmarkLSystemView();
+	benchmarkLSystemDAG();
+	benchmarkPackedString();
+	benchmarkTurtle();
+	benchmarkParallelTurtle();
+	benchmarkCulling();
+	benchmarkMeshCooking();
+}
 
 
+/**
+ * @brief Time random seeks into the requested generation and check them
+ * against a serial walk of the expanded string
+ */
+void benchmarkLSystemView()
+{
+	LSystemView view{ generation };
+	std::string expanded = expandTo(generation);
+	printf("L-system seeking into %llu symbols\n", view.size());
+	if (view.size() != expanded.size() || expanded.empty())
+	{
+		printf("the view has the wrong size!\n");
+		return;
 	}
-	glutPostRedisplay();
-}
 
-void onMouseClick(int button, int state, int x, int y)
-{
-	if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+	const int seeks = 100000;
+	std::vector<unsigned long long> offsets(seeks);
+	unsigned long long random = 88172645463325252ull;
+	for (auto& offset : offsets)
 	{
-		//store the x,y value where the click happened
-		A += 11.0f;
+		// xorshift, so the offsets are the same on every run
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		offset = random % expanded.size();
 	}
-	if (button == GLUT_RIGHT_BUTTON && state == GLUT_DOWN)
+	TurtleContext context;
+	unsigned long long checksum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (auto offset : offsets)
+		checksum += view.seek(offset, &context) + context.stack.size();
+	auto end = std::chrono::steady_clock::now();
+	printf("%d seeks with context in %.3f ms (%.1f ns per seek, checksum %llu)\n", seeks,
+		std::chrono::duration<double, std::milli>(end - start).count(),
+		std::chrono::duration<double, std::nano>(end - start).count() / seeks, checksum);
+
+	// serial walk over the string, comparing every sampled offset on the way
+	std::sort(offsets.begin(), offsets.end());
+	long long turns = 0;
+	std::vector<long long> stack;
+	size_t next = 0, mismatches = 0;
+	for (size_t i = 0; i < expanded.size() && next < offsets.size(); i++)
 	{
-		//store the x,y value where the click happened
-		A -= 11.0f;
+		while (next < offsets.size() && offsets[next] == i)
+		{
+			char symbol = view.seek(i, &context);
+			if (symbol != expanded[i] || context.stack.size() != stack.size() ||
+				(context.valid && context.state.turns != turns))
+				mismatches++;
+			next++;
+		}
+		if (expanded[i] == '+')
+			turns++;
+		else if (expanded[i] == '-')
+			turns--;
+		else if (expanded[i] == '[')
+			stack.push_back(turns);
+		else if (expanded[i] == ']' && !stack.empty())
+		{
+			turns = stack.back();
+			stack.pop_back();
+		}
 	}
-	if (button == GLUT_MIDDLE_BUTTON && state == GLUT_DOWN)
+	LSystemStream stream = view.streamFrom(offsets[seeks / 2]);
+	char symbol;
+	for (size_t i = offsets[seeks / 2]; i < expanded.size(); i++)
 	{
-		//store the x,y value where the click happened
-		A = 0.0f;
+		if (!stream.next(symbol) || symbol != expanded[i])
+		{
+			mismatches++;
+			break;
+		}
 	}
+	printf("%zu mismatches against the expanded string\n", mismatches);
 }
 
 
 /**
- * @brief Initialize the axiom and rules for the L-System
+ * @brief Time reading the requested generation from the stored string, the
+ * stream and the DAG, and check that all three produce the same symbols
  */
-void LSystemRules()
+void benchmarkLSystemDAG()
 {
-	if (file.is_open())
-	{
-		std::string line;
-		while (std::getline(file, line))
-		{
-			if (line.length() == 1)
-			{
-				axiom = line;
-			}
-			else
-			{
-				char key = line[0];
-				std::string value = line.substr(2);
-				grammers.insert({ key, value });
-			}
-		}
-		tree = axiom;
-		file.close();
-	}
+	std::string expanded = expandTo(generation);
+	auto checksum = [](unsigned long long& sum, char symbol) { sum = sum * 31 + (unsigned char)symbol; };
+
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long stringSum = 0;
+	for (auto& symbol : expanded)
+		checksum(stringSum, symbol);
+	auto stringEnd = std::chrono::steady_clock::now();
+	unsigned long long streamSum = 0;
+	LSystemStream stream{ axiom, generation };
+	char symbol;
+	while (stream.next(symbol))
+		checksum(streamSum, symbol);
+	auto streamEnd = std::chrono::steady_clock::now();
+	LSystemDAG dag{ generation };
+	auto buildEnd = std::chrono::steady_clock::now();
+	unsigned long long dagSum = 0;
+	dag.walk([&](char symbol) { checksum(dagSum, symbol); });
+	auto dagEnd = std::chrono::steady_clock::now();
+
+	printf("L-system DAG : %zu nodes for %llu symbols, built in %.3f ms\n", dag.nodeCount(), dag.size(),
+		std::chrono::duration<double, std::milli>(buildEnd - streamEnd).count());
+	printf("reading %zu symbols : string %.3f ms, stream %.3f ms, DAG %.3f ms\n", expanded.size(),
+		std::chrono::duration<double, std::milli>(stringEnd - start).count(),
+		std::chrono::duration<double, std::milli>(streamEnd - stringEnd).count(),
+		std::chrono::duration<double, std::milli>(dagEnd - buildEnd).count());
+	if (streamSum != stringSum || dagSum != stringSum || dag.size() != expanded.size())
+		printf("the stream or the DAG differs from the string!\n");
 }
 
 
 /**
- * @brief Create L-system string
+ * @brief Time packed rewriting against rewrite(), compare the memory of both
+ * and check the unpacked result and the packed symbol counts
  */
-void LSystemString()
+void benchmarkPackedString()
 {
+	if (alphabet.bits == 0)
+	{
+		printf("the l-system has too many symbols to pack\n");
+		return;
+	}
+	std::string expanded;
+	PackedString packed, packedBuffer;
+	packed.reset(alphabet.bits, axiom.size());
+	for (size_t i = 0; i < axiom.size(); i++)
+		packed.set(i, alphabet.code[(unsigned char)axiom[i]]);
+
+	auto start = std::chrono::steady_clock::now();
+	expanded = expandTo(generation);
+	auto stringEnd = std::chrono::steady_clock::now();
 	for (int i = 0; i < generation; i++)
 	{
-		std::string newTree;
-		for (auto& symbol : tree)
-		{
-			if (grammers.count(symbol))
-				newTree += grammers[symbol];
-			else
-				newTree += symbol;
-		}
-		tree = newTree;
+		rewritePacked(packed, packedBuffer);
+		std::swap(packed, packedBuffer);
 	}
+	auto packedEnd = std::chrono::steady_clock::now();
+	std::string unpacked(packed.size(), 0);
+	packed.unpack(alphabet, 0, packed.size(), &unpacked[0]);
+	auto unpackEnd = std::chrono::steady_clock::now();
+
+	printf("L-system packed with %d bits per symbol (%d symbols)\n", alphabet.bits, alphabet.size);
+	printf("rewriting : string %.3f ms for %zu bytes, packed %.3f ms for %zu bytes, unpacking %.3f ms\n",
+		std::chrono::duration<double, std::milli>(stringEnd - start).count(), expanded.size(),
+		std::chrono::duration<double, std::milli>(packedEnd - stringEnd).count(), packed.bytes(),
+		std::chrono::duration<double, std::milli>(unpackEnd - packedEnd).count());
+	if (unpacked != expanded ||
+		packed.count(alphabet.code['F']) != (size_t)std::count(expanded.begin(), expanded.end(), 'F'))
+		printf("the packed string differs from the string!\n");
 }
 
 
 /**
- * @brief Create L-system
+ * @brief The turtle the way createEdge() worked before the closed form, with a
+ * matrix per edge. Only kept for benchmarkTurtle().
  */
-void LSystem()
+void interpretWithMatrices(const std::string& symbols, std::vector<Edge>& out)
 {
-	for (auto& symbol : tree)
+	struct State
+	{
+		Edge edge;
+		GLfloat angle;
+	};
+	std::vector<State> stack;
+	GLfloat heading = 0.0f;
+	Edge poppedEdge;
+	bool popped = false;
+	for (auto& symbol : symbols)
 	{
 		if (symbol == 'F')
 		{
-			createEdge();
+			if (out.empty())
+			{
+				point3 startPoint{ 0, -0.5f, 0.0 };
+				out.push_back({ startPoint, point3{ startPoint.x, startPoint.y + gl_len, startPoint.z } });
+				continue;
+			}
+			Edge edge = popped ? poppedEdge : out.back();
+			popped = false;
+			point3 end = edge.endPoint;
+			point3 tempEnd{ end.x, end.y + gl_len, end.z };
+			mat4 tempEndMat4{ tempEnd.x, tempEnd.y, tempEnd, 1 };
+			mat4 newEndMat = Translate(end) * (Rotate(heading, 0, 0, 1) * Translate(-end) * tempEndMat4);
+			out.push_back({ end, point3{ newEndMat[0].x, newEndMat[1].y, 0.0 } });
 		}
 		else if (symbol == '+')
-		{
-			rotateLeft();
-		}
+			heading += angle;
 		else if (symbol == '-')
-		{
-			rotateRight();
-		}
+			heading -= angle;
 		else if (symbol == '[')
-		{
-			push();
-		}
+			stack.push_back({ out.back(), heading });
 		else if (symbol == ']')
 		{
-			pop();
+			poppedEdge = stack.back().edge;
+			heading = stack.back().angle;
+			stack.pop_back();
+			popped = true;
 		}
 	}
 }
 
-void createEdge()
+
+/**
+ * @brief Count edges per second of the matrix turtle against the closed form
+ * one and report how far apart their points are
+ */
+void benchmarkTurtle()
 {
-	if (edges.empty())
+	std::string expanded = expandTo(generation);
+	std::vector<Edge> matrixEdges;
+	matrixEdges.reserve(lsystemSizes.empty() ? 0 : lsystemSizes.back().edges);
+	auto start = std::chrono::steady_clock::now();
+	interpretWithMatrices(expanded, matrixEdges);
+	auto matrixEnd = std::chrono::steady_clock::now();
+	edges.clear();
+	memories.clear();
+	edges.reserve(matrixEdges.size());
+	turtle = Memory{ point3{ 0, -0.5f, 0.0 }, 0 };
+	headings.reset(angle, gl_len);
+	for (auto& symbol : expanded)
+		interpret(symbol);
+	auto turtleEnd = std::chrono::steady_clock::now();
+
+	double matrixSeconds = std::chrono::duration<double>(matrixEnd - start).count();
+	double turtleSeconds = std::chrono::duration<double>(turtleEnd - matrixEnd).count();
+	printf("turtle : %zu edges, %d headings per circle (0 : not periodic)\n", edges.size(), headings.period());
+	printf("matrices %.2f M edges/s, heading table %.2f M edges/s\n",
+		matrixEdges.size() / matrixSeconds * 1e-6, edges.size() / turtleSeconds * 1e-6);
+	if (edges.size() != matrixEdges.size())
 	{
-		point3 startPoint{ 0, -0.5f, 0.0 };
-		point3 endPoint{ startPoint.x, startPoint.y + gl_len, startPoint.z };
-		Edge edge{ startPoint, endPoint };
-		edges.push_back(edge);
+		printf("the turtles drew a different number of edges!\n");
 		return;
 	}
-	Edge edge;
-	if (gl_poped)
+	float largest = 0.0f;
+	size_t identical = 0;
+	for (size_t i = 0; i < edges.size(); i++)
 	{
-		edge = gl_poped_edge;
-		gl_poped = false;
+		vec3 difference = edges[i].endPoint - matrixEdges[i].endPoint;
+		largest = std::max({ largest, std::fabs(difference.x), std::fabs(difference.y) });
+		identical += difference.x == 0.0f && difference.y == 0.0f;
 	}
-	else
-	{
-		edge = edges.back();
-	}
-	// get the last edge's end point
-	point3 end = edge.endPoint;
-	// step 1 : draw a straight line for the end point base on y axis, get the a temp end point
-	point3 tempEnd{ end.x, end.y + gl_len, end.z };
-	// step 2 : translate the temp end point to matrix 4
-	mat4 tempEndMat4{ tempEnd.x, tempEnd.y, tempEnd, 1 };
-	// calculate the translate matrix for end point to origin, since the end point will be the start point of new edge
-	mat4 transMatToOrigin{ Translate(-end) };
-	// calculate the rotation matrix for angle base on Z axis (RotateZ)
-	mat4 rotMat{ Rotate(gl_angle, 0, 0, 1) };
-	// calculate the scaling matrix
-	// mat4 scalMat{Scale(gl_scale, gl_scale, 0)};
-	// calculate the translate matrix for moving the point back
-	mat4 transMatToStartPoint{ Translate(end) };
-	// calculate the end point at origin scaled and rotated
-	mat4 endPointMatAtOrigin = rotMat * transMatToOrigin * tempEndMat4;
-	// calculate the end point translated back
-	mat4 newEndMat = transMatToStartPoint * endPointMatAtOrigin;
-	// get the new end point
-	point3 newEndPoint{ newEndMat[0].x, newEndMat[1].y, 0.0 };
-	// the old end point will be used for the new start point
-	Edge newEdge = { end, newEndPoint };
-
-	edges.push_back(newEdge);
+	printf("%zu end points bit-for-bit identical, largest difference %g\n", identical, largest);
+	edges.clear();
 }
 
-void rotateLeft()
-{
-	gl_angle += angle;
-}
 
-void rotateRight()
+/**
+ * @brief Time the serial turtle against interpretParallel() and compare their edges
+ */
+void benchmarkParallelTurtle()
 {
-	gl_angle -= angle;
+	std::string expanded = expandTo(generation);
+	tree.swap(expanded);
+	auto reset = []()
+	{
+		edges.clear();
+		memories.clear();
+		turtle = Memory{ point3{ 0, -0.5f, 0.0 }, 0 };
+		headings.reset(angle, gl_len);
+	};
+
+	// the fastest of a few runs, the first ones also fault in the pages of edges
+	const int runs = 3;
+	double serial = DBL_MAX, parallel = DBL_MAX;
+	std::vector<Edge> serialEdges;
+	for (int run = 0; run < runs; run++)
+	{
+		serialEdges.swap(edges);
+		reset();
+		auto start = std::chrono::steady_clock::now();
+		for (auto& symbol : tree)
+			interpret(symbol);
+		auto serialEnd = std::chrono::steady_clock::now();
+		serialEdges.swap(edges);
+		reset();
+		interpretParallel(tree.size(), StringReader{});
+		auto parallelEnd = std::chrono::steady_clock::now();
+		serial = std::min(serial, std::chrono::duration<double, std::milli>(serialEnd - start).count());
+		parallel = std::min(parallel, std::chrono::duration<double, std::milli>(parallelEnd - serialEnd).count());
+	}
+
+	printf("turtle on %u threads : serial %.3f ms, parallel %.3f ms (fastest of %d runs)\n", numThreads, serial, parallel, runs);
+	float largest = 0.0f;
+	for (size_t i = 0; i < edges.size() && i < serialEdges.size(); i++)
+	{
+		vec3 difference = edges[i].endPoint - serialEdges[i].endPoint;
+		largest = std::max({ largest, std::fabs(difference.x), std::fabs(difference.y) });
+	}
+	printf("%zu edges against %zu serial ones, largest difference %g\n", edges.size(), serialEdges.size(), largest);
+	tree.swap(expanded);
+	reset();
 }
 
-void push()
+
+/**
+ * @brief Time culling the l-system against the frustum while it turns around,
+ * with the three default trees, and report how much of it is drawn
+ */
+void benchmarkCulling()
 {
-	Memory memory = { edges.back(), gl_angle };
-	memories.push_back(memory);
+	std::string expanded = expandTo(generation);
+	edges.clear();
+	memories.clear();
+	turtle = Memory{ point3{ 0, -0.5f, 0.0 }, 0 };
+	headings.reset(angle, gl_len);
+	for (auto& symbol : expanded)
+		interpret(symbol);
+	simplifyEdges(edges);
+	buildStrips(edges, lsystemIndices, [](const point3&) {});
+	auto start = std::chrono::steady_clock::now();
+	lsystemBVH.build(edges, lsystemIndices);
+	auto built = std::chrono::steady_clock::now();
+
+	plantForest();
+	aspect = width / height;
+	mat4 p = Perspective(fovy, aspect, zNear, zFar);
+	vec4 at(0.0f, 0.0f, 0.0f, 1.0f);
+	vec4 up(0.0f, 1.0f, 0.0f, 0.0f);
+	vec4 eye(0.0, 0.0, 1.0f, 1.0);
+	mat4 model_view = LookAt(eye, at, up);
+	const int frames = 360;
+	std::vector<GLsizei> counts;
+	std::vector<GLuint> firsts;
+	size_t visited = 0, ranges = 0;
+	unsigned long long drawn = 0;
+	auto cullStart = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++)
+	{
+		A = (GLfloat)frame;
+		for (auto& tree : forest)
+		{
+			counts.clear();
+			firsts.clear();
+			lsystemBVH.cull(p * model_view * treeModel(tree), counts, firsts, visited);
+			ranges += counts.size();
+			for (auto& count : counts)
+				drawn += count;
+		}
+	}
+	auto cullEnd = std::chrono::steady_clock::now();
+	A = 0.0f;
+	printf("culling : %zu edges, %zu nodes built in %.3f ms\n", edges.size(), lsystemBVH.nodeCount(),
+		std::chrono::duration<double, std::milli>(built - start).count());
+	printf("%.1f us per frame for %zu trees, %zu nodes and %.1f ranges per tree, %.1f%% of the indices drawn\n",
+		std::chrono::duration<double, std::micro>(cullEnd - cullStart).count() / frames, forest.size(),
+		visited / (frames * forest.size()), (double)ranges / (frames * forest.size()),
+		100.0 * drawn / ((double)lsystemIndices.size() * frames * forest.size()));
 }
 
-void pop()
+
+/**
+ * @brief Time cookMesh on triangle soups of square grids of growing size,
+ * up to 2M triangles, to check it stays linear
+ */
+void benchmarkMeshCooking()
 {
-	Memory memory = memories.back();
-	gl_poped_edge = memory.edge;
-	gl_angle = memory.angle;
-	memories.pop_back();
-	gl_poped = true;
+	for (int side = 256; side <= 1024; side *= 2)
+	{
+		// two triangles per cell, rows of cells in order like an exporter would write them
+		std::vector<GLfloat> soup;
+		soup.reserve((size_t)side * side * 18);
+		const int corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+		for (int y = 0; y < side; y++)
+			for (int x = 0; x < side; x++)
+				for (auto& corner : corners)
+				{
+					soup.push_back((GLfloat)(x + corner[0]));
+					soup.push_back((GLfloat)(y + corner[1]));
+					soup.push_back(0.0f);
+				}
+		std::vector<GLfloat> vertices;
+		std::vector<GLuint> indices;
+		GLfloat weldedMisses, cookedMisses;
+		auto start = std::chrono::steady_clock::now();
+		cookMesh(soup.data(), 3, soup.size() / 3, vertices, indices, &weldedMisses, &cookedMisses);
+		auto end = std::chrono::steady_clock::now();
+		printf("mesh cooking : %zu triangles, %zu vertices welded to %zu in %.1f ms, %.2f cache misses per triangle reordered to %.2f\n",
+			indices.size() / 3, soup.size() / 3, vertices.size() / 3,
+			std::chrono::duration<double, std::milli>(end - start).count(), weldedMisses, cookedMisses);
+	}
 }
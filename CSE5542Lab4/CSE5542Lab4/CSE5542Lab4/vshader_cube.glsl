@@ -4,11 +4,21 @@ layout (location = 1) in vec2 aTexCoords;
 
 out vec2 TexCoords;
 
-uniform mat4 view;
-uniform mat4 projection;
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+    mat4 model;
+};
 
 void main()
 {
     TexCoords = aTexCoords;    
-    gl_Position = projection * view * vec4(aPos, 1.0);
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
 }
\ No newline at end of file
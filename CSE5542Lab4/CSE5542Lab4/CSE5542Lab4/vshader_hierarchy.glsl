@@ -0,0 +1,86 @@
+/***************************
+ * File: vshader_hierarchy.glsl:
+ *   Vertex shader of the l-system drawn as copies of leaf meshes.
+ *
+ * - Copy gl_InstanceID of the leaf mesh is found by walking down the tree of
+ *   turtle moves in the buffer texture hierarchy, the way LSystemView seeks.
+ *
+ * - The tree itself is placed like in vshader_lsystem.glsl.
+ ***************************/
+
+#version 330
+
+layout (location = 0) in vec3 vPosition;
+layout (location = 1) in vec3 vColor;
+layout (location = 2) in vec3 vOffset; // per tree : position
+layout (location = 3) in vec2 vTransform; // per tree : rotation (radians) and scale
+layout (location = 5) in vec3 vTint; // per tree : multiplies the color
+out vec4 color;
+
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+    mat4 model;
+};
+uniform float treeRotation; // every tree around its own axis
+uniform float forestRotation; // all trees around the origin
+
+uniform usamplerBuffer hierarchy; // node headers and children, see LSystemHierarchy
+uniform uint root; // node of the axiom
+uniform int steps; // levels from the root down to the leaves
+uniform uint leaf; // leaf mesh drawn
+uniform float angle; // turn of '+' in radians
+
+// rotate p around the y axis like Rotate(angle, 0, 1, 0)
+vec3 rotateY(vec3 p, float angle)
+{
+    float c = cos(angle);
+    float s = sin(angle);
+    return vec3(c * p.x + s * p.z, p.y, -s * p.x + c * p.z);
+}
+
+// rotate p in the plane of the turtle
+vec2 turn(vec2 p, float turns)
+{
+    float c = cos(turns * angle);
+    float s = sin(turns * angle);
+    return vec2(c * p.x - s * p.y, s * p.x + c * p.y);
+}
+
+void main() 
+{
+    uint copy = uint(gl_InstanceID);
+    uint node = root;
+    vec2 position = vec2(0.0);
+    float turns = 0.0;
+    for (int step = 0; step < steps; step++)
+    {
+        uvec4 header = texelFetch(hierarchy, int(node));
+        // the last child with at most copy leaves before it holds the copy
+        int child = int(header.x);
+        for (uint i = 1u; i < header.y; i++)
+        {
+            int next = int(header.x + 2u * i);
+            if (texelFetch(hierarchy, next + 1)[leaf] > copy)
+                break;
+            child = next;
+        }
+        uvec4 move = texelFetch(hierarchy, child);
+        copy -= texelFetch(hierarchy, child + 1)[leaf];
+        position += turn(vec2(uintBitsToFloat(move.x), uintBitsToFloat(move.y)), turns);
+        turns += float(int(move.z));
+        node = move.w;
+    }
+    vec3 local = vec3(position + turn(vPosition.xy, turns), vPosition.z);
+    vec3 world = rotateY(vOffset + rotateY(local * vTransform.y, vTransform.x + treeRotation), forestRotation);
+
+    gl_Position = projection * view * model * vec4(world, 1.0);
+    color = vec4(vColor * vTint, 1.0);
+}
@@ -1,9 +1,18 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+	mat4 view;
+	mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+	mat4 model;
+};
 
 void main()
 {
@@ -5,14 +5,23 @@ layout (location = 1) in vec3 aNormal;
 out vec3 FragPos;
 out vec3 Normal;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+    mat4 model;
+};
 
 void main()
 {
-    FragPos = vec3(model * vec4(aPos, 1.0));
+    FragPos = aPos; // lit in the space of the cube
     Normal = aNormal;  
     
-    gl_Position = projection * view * vec4(FragPos, 1.0);
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
 }
\ No newline at end of file
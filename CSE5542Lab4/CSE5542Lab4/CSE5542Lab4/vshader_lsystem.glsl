@@ -5,8 +5,8 @@
  * - Vertex attributes (positions & colors) for all vertices are sent
  *   to the GPU via a vertex buffer object created in the OpenGL program.
  *
- * - This vertex shader uses the Model-View and Projection matrices passed
- *   on from the OpenGL program as uniform variables of type mat4.
+ * - This vertex shader uses the View and Projection matrices of the uniform
+ *   block Frame and the Model matrix of the uniform block Object.
  ***************************/
 
 #version 330 //  Comment/un-comment this line to resolve compilation errors
@@ -14,18 +14,44 @@
 
 layout (location = 0) in vec3 vPosition;
 layout (location = 1) in vec3 vColor;
-layout (location = 2) in vec3 vOffset; 
+layout (location = 2) in vec3 vOffset; // per tree : position
+layout (location = 3) in vec2 vTransform; // per tree : rotation (radians) and scale
 layout (location = 4) in vec2 aTexCoords;
+layout (location = 5) in vec4 vTint; // per tree : multiplies the color, alpha fades between levels of detail
 out vec4 color;
 out vec2 TexCoords;
 
-uniform mat4 view;
-uniform mat4 projection;
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+    mat4 model;
+};
+uniform vec3 positionScale; // dequantization of 16 bit positions, 1 for float ones
+uniform vec3 positionOffset;
+uniform float treeRotation; // every tree around its own axis
+uniform float forestRotation; // all trees around the origin
+
+// rotate p around the y axis like Rotate(angle, 0, 1, 0)
+vec3 rotateY(vec3 p, float angle)
+{
+    float c = cos(angle);
+    float s = sin(angle);
+    return vec3(c * p.x + s * p.z, p.y, -s * p.x + c * p.z);
+}
 
 void main() 
 {
-    vec4 vPosition4 = vec4(vPosition.x + vOffset.x, vPosition.y + vOffset.y, vPosition.z, 1.0);
-    vec4 vColor4 = vec4(vColor.r, vColor.g, vColor.b, 1.0); 
+    vec3 position = vPosition * positionScale + positionOffset;
+    position = rotateY(vOffset + rotateY(position * vTransform.y, vTransform.x + treeRotation), forestRotation);
+    vec4 vPosition4 = vec4(position, 1.0);
+    vec4 vColor4 = vec4(vColor * vTint.rgb, vTint.a); 
 
     // JC: build-in variable in GLSL
     //  gl_Position is the first one we see here.
@@ -34,7 +60,7 @@ void main()
     //  By convention, all predefined variables start with "gl_"; 
     //     no user-defined variables may start with this.
     //  see here: https://www.khronos.org/opengl/wiki/Built-in_Variable_(GLSL) for the list of build in variables.
-    gl_Position = projection * view * vPosition4;
+    gl_Position = projection * view * model * vPosition4;
 
     TexCoords = aTexCoords;  
     color = vColor4;
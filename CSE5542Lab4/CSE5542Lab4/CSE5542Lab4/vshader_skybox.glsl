@@ -3,12 +3,22 @@ layout (location = 0) in vec3 aPos;
 
 out vec3 TexCoords;
 
-uniform mat4 projection;
-uniform mat4 view;
+// per frame, written once by display()
+layout (std140, row_major) uniform Frame
+{
+    mat4 view;
+    mat4 projection;
+};
+
+// per object, display() binds the slot of the object drawn
+layout (std140, row_major) uniform Object
+{
+    mat4 model;
+};
 
 void main()
 {
     TexCoords = aPos;
-    vec4 pos = projection * view * vec4(aPos, 1.0);
+    vec4 pos = projection * mat4(mat3(view * model)) * vec4(aPos, 1.0); // remove translation from the view matrix
     gl_Position = pos.xyww;
 }  
\ No newline at end of file